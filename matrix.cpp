@@ -0,0 +1,902 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// The transport matrix: plays ttt games through layouts of mync processes and times them.
+// mync and ttt run as subprocesses, so the figures are those of the binaries being tested.
+
+#define MATRIX_MAX_STAGES 2
+#define MATRIX_MAX_ARGS 8
+#define MATRIX_ARG_SIZE 128
+#define MATRIX_TRANSCRIPT_SIZE 16384
+#define MATRIX_RETRY_NS 10000000ull
+#define MATRIX_READY_NS 2000000000ull
+#define MATRIX_PORT_TRIES 50
+#define MATRIX_BOT_ORDER "513792468"
+#define MATRIX_PROMPT "Choose a location"
+
+#define LATENCY_SUB_BUCKETS 32
+#define LATENCY_BUCKETS (60 * LATENCY_SUB_BUCKETS)
+
+uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * write_all: Writes a whole buffer, retrying after partial writes and interrupts.
+ * @return 0 on success, -1 on failure.
+ */
+int write_all(int fd, const char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, buffer, length);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/**
+ * A log-linear latency histogram, the same as mync's: values below 32 ns have their own bucket,
+ * larger values share 32 buckets per power of two.
+ */
+struct latency_histogram
+{
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+int latency_bucket(uint64_t value)
+{
+    if (value < LATENCY_SUB_BUCKETS)
+        return value;
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (value >> (exponent - 5)) & (LATENCY_SUB_BUCKETS - 1);
+    return (exponent - 4) * LATENCY_SUB_BUCKETS + sub;
+}
+
+uint64_t latency_bucket_value(int bucket)
+{
+    if (bucket < LATENCY_SUB_BUCKETS)
+        return bucket;
+    int exponent = bucket / LATENCY_SUB_BUCKETS + 4;
+    int sub = bucket % LATENCY_SUB_BUCKETS;
+    return (uint64_t)(LATENCY_SUB_BUCKETS + sub) << (exponent - 5);
+}
+
+void latency_record(struct latency_histogram *histogram, uint64_t value)
+{
+    histogram->counts[latency_bucket(value)]++;
+    histogram->total++;
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+/**
+ * latency_percentile: Returns the value below which the given fraction of samples fall.
+ * @param fraction: The percentile as a fraction, e.g. 0.99.
+ */
+uint64_t latency_percentile(const struct latency_histogram *histogram, double fraction)
+{
+    uint64_t rank = (uint64_t)(fraction * histogram->total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if (seen >= rank)
+            return latency_bucket_value(i) < histogram->max ? latency_bucket_value(i) : histogram->max;
+    }
+    return histogram->max;
+}
+
+/**
+ * Where the harness plays one side of a game: the moves go in and the board comes out through
+ * the last process's stdin or stdout, a client endpoint that the harness connects to, or a TCP
+ * port that the harness listens on for the topology to connect to.
+ */
+enum matrix_attach
+{
+    MATRIX_PIPE,
+    MATRIX_CONNECT,
+    MATRIX_LISTEN
+};
+
+/**
+ * A layout of mync processes around ttt. Arguments may hold %T for the ttt command, %P and %Q
+ * for two ports and %U for an abstract UDS name. When there are two processes, the second one
+ * starts once the first one logged its ready line, which it does with its endpoint open.
+ */
+struct matrix_topology
+{
+    const char *name;
+    const char *args[MATRIX_MAX_STAGES][MATRIX_MAX_ARGS];
+    const char *ready;
+    enum matrix_attach moves;
+    enum matrix_attach board;
+    const char *endpoint;
+};
+
+static const struct matrix_topology matrix_topologies[] = {
+    // Question 3: both ways, input only, output only, input and output on two ports
+    {"tcp", {{"-e", "%T", "-b", "TCPS%P"}}, NULL, MATRIX_CONNECT, MATRIX_CONNECT, "TCPClocalhost,%P"},
+    {"tcp-in", {{"-e", "%T", "-i", "TCPS%P"}}, NULL, MATRIX_CONNECT, MATRIX_PIPE, "TCPClocalhost,%P"},
+    {"tcp-out", {{"-e", "%T", "-o", "TCPS%P"}}, NULL, MATRIX_PIPE, MATRIX_CONNECT, "TCPClocalhost,%P"},
+    {"tcp-chain", {{"-e", "%T", "-i", "TCPS%P", "-o", "TCPClocalhost,%Q"}}, NULL, MATRIX_CONNECT, MATRIX_LISTEN, "TCPClocalhost,%P"},
+    // Question 4: moves over UDP, the board on stdout or over TCP
+    {"udp-in", {{"-e", "%T", "-i", "UDPS%P"}}, NULL, MATRIX_CONNECT, MATRIX_PIPE, "UDPClocalhost,%P"},
+    {"udp-chain", {{"-e", "%T", "-i", "UDPS%P", "-o", "TCPClocalhost,%Q"}}, NULL, MATRIX_CONNECT, MATRIX_LISTEN, "UDPClocalhost,%P"},
+    {"udp-sessions", {{"-e", "%T", "-b", "UDPS%P", "-s", "5"}}, NULL, MATRIX_CONNECT, MATRIX_CONNECT, "UDPClocalhost,%P"},
+    // Question 6
+    {"uds-stream", {{"-e", "%T", "-b", "UDSSS%U"}}, NULL, MATRIX_CONNECT, MATRIX_CONNECT, "UDSCS%U"},
+    {"uds-dgram", {{"-e", "%T", "-b", "UDSSD%U"}}, NULL, MATRIX_CONNECT, MATRIX_CONNECT, "UDSCD%U"},
+    {"uds-seqpacket", {{"-e", "%T", "-b", "UDSSP%U"}}, NULL, MATRIX_CONNECT, MATRIX_CONNECT, "UDSCP%U"},
+    // Two mync instances: reliable datagrams, and a multiplexed link
+    {"reliable-udp", {{"-v", "-R", "-e", "%T", "-b", "UDPS%P"}, {"-R", "-b", "UDPClocalhost,%P"}}, "Waiting for the reliable session's client", MATRIX_PIPE, MATRIX_PIPE, NULL},
+    {"mux", {{"-v", "-m", "accept", "-i", "TCPS%Q", "-e", "%T"}, {"-m", "connect", "-i", "TCPS%P", "-o", "TCPClocalhost,%Q"}}, "Multiplexing links into sessions", MATRIX_CONNECT, MATRIX_CONNECT, "TCPClocalhost,%P"},
+};
+
+/**
+ * Settings of the transport matrix, given as comma separated key=value pairs. Every topology
+ * plays games games of ttt with sequence, each with freshly started processes, and a game that
+ * did not end within timeout seconds counts as an error.
+ */
+struct matrix_config
+{
+    int games;
+    const char *mync;
+    const char *ttt;
+    const char *sequence;
+    int port;
+    const char *only;
+    const char *csv;
+    const char *label;
+    double timeout;
+};
+
+struct matrix_result
+{
+    struct latency_histogram setup;
+    struct latency_histogram move;
+    struct latency_histogram game;
+    int games;
+    int errors;
+};
+
+/**
+ * parse_matrix_config: Parses the settings, keys that are not given keep their defaults.
+ * @param spec: The settings, or NULL for the defaults.
+ * @return 0 on success, -1 on an unknown key or a bad value.
+ */
+int parse_matrix_config(char *spec, struct matrix_config *config)
+{
+    config->games = 20;
+    config->mync = "./mync";
+    config->ttt = "./ttt";
+    config->sequence = "123456789";
+    config->port = 4050;
+    config->only = NULL;
+    config->csv = NULL;
+    config->label = "";
+    config->timeout = 5;
+
+    for (char *item = spec != NULL ? strtok(spec, ",") : NULL; item != NULL; item = strtok(NULL, ","))
+    {
+        char *value = strchr(item, '=');
+        if (value == NULL)
+            return -1;
+        *value++ = '\0';
+        if (strcmp(item, "games") == 0)
+            config->games = atoi(value);
+        else if (strcmp(item, "mync") == 0)
+            config->mync = value;
+        else if (strcmp(item, "ttt") == 0)
+            config->ttt = value;
+        else if (strcmp(item, "sequence") == 0)
+            config->sequence = value;
+        else if (strcmp(item, "port") == 0)
+            config->port = atoi(value);
+        else if (strcmp(item, "only") == 0)
+            config->only = value;
+        else if (strcmp(item, "csv") == 0)
+            config->csv = value;
+        else if (strcmp(item, "label") == 0)
+            config->label = value;
+        else if (strcmp(item, "timeout") == 0)
+            config->timeout = atof(value);
+        else
+            return -1;
+    }
+    // ttt plays every location once, in the order of the sequence
+    bool seen[10] = {false};
+    for (const char *digit = config->sequence; *digit != '\0'; digit++)
+    {
+        if (*digit < '1' || *digit > '9' || seen[*digit - '0'])
+            return -1;
+        seen[*digit - '0'] = true;
+    }
+    if (strlen(config->sequence) != 9 || config->games <= 0 || config->port <= 0 || config->port >= 65535 ||
+        config->timeout <= 0)
+        return -1;
+    return 0;
+}
+
+bool matrix_line(const char *board, char mark)
+{
+    static const int lines[8][3] = {{0, 1, 2}, {3, 4, 5}, {6, 7, 8}, {0, 3, 6}, {1, 4, 7}, {2, 5, 8}, {0, 4, 8}, {2, 4, 6}};
+    for (int i = 0; i < 8; i++)
+    {
+        if (board[lines[i][0]] == mark && board[lines[i][1]] == mark && board[lines[i][2]] == mark)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * matrix_bot_move: The bot's move: a win if there is one, else a block of the alien's win, else
+ *                  the first free location of MATRIX_BOT_ORDER.
+ */
+int matrix_bot_move(char *board)
+{
+    const char marks[2] = {'O', 'X'};
+    for (int m = 0; m < 2; m++)
+    {
+        for (int cell = 0; cell < 9; cell++)
+        {
+            if (board[cell] != ' ')
+                continue;
+            board[cell] = marks[m];
+            bool line = matrix_line(board, marks[m]);
+            board[cell] = ' ';
+            if (line)
+                return cell + 1;
+        }
+    }
+    for (const char *location = MATRIX_BOT_ORDER; *location != '\0'; location++)
+    {
+        if (board[*location - '1'] == ' ')
+            return *location - '0';
+    }
+    return 0;
+}
+
+/**
+ * matrix_script: Plays the game ahead of time. ttt's alien takes the first free location of its
+ *                sequence, so the bot's moves are known before the game starts.
+ * @param moves: Receives the bot's moves, at most 4 digits.
+ */
+void matrix_script(const char *sequence, char *moves)
+{
+    char board[9];
+    memset(board, ' ', sizeof(board));
+    const char *next = sequence;
+    int count = 0;
+    for (int turn = 0; turn < 5; turn++)
+    {
+        while (board[*next - '1'] != ' ')
+            next++;
+        board[*next - '1'] = 'X';
+        if (matrix_line(board, 'X') || turn == 4)
+            break;
+        int location = matrix_bot_move(board);
+        board[location - 1] = 'O';
+        moves[count++] = '0' + location;
+        if (matrix_line(board, 'O'))
+            break;
+    }
+    moves[count] = '\0';
+}
+
+/**
+ * matrix_expand: Fills in the placeholders of a topology argument.
+ */
+void matrix_expand(const char *pattern, char *out, const char *ttt_command, int port, const char *uds)
+{
+    size_t length = 0;
+    for (const char *p = pattern; *p != '\0' && length < MATRIX_ARG_SIZE - 1; p++)
+    {
+        char value[MATRIX_ARG_SIZE];
+        if (p[0] != '%' || p[1] == '\0')
+        {
+            out[length++] = *p;
+            continue;
+        }
+        p++;
+        if (*p == 'T')
+            snprintf(value, sizeof(value), "%s", ttt_command);
+        else if (*p == 'P' || *p == 'Q')
+            snprintf(value, sizeof(value), "%d", *p == 'P' ? port : port + 1);
+        else
+            snprintf(value, sizeof(value), "%s", uds);
+        length += snprintf(out + length, MATRIX_ARG_SIZE - length, "%s", value);
+        if (length > MATRIX_ARG_SIZE - 1)
+            length = MATRIX_ARG_SIZE - 1;
+    }
+    out[length] = '\0';
+}
+
+/**
+ * matrix_port_free: Checks that a TCP and a UDP socket can both be bound to a port. The TCP
+ *                   socket sets SO_REUSEADDR like mync's servers, so a port in TIME_WAIT of an
+ *                   earlier game counts as free.
+ */
+bool matrix_port_free(int port)
+{
+    const int types[2] = {SOCK_STREAM, SOCK_DGRAM};
+    for (int i = 0; i < 2; i++)
+    {
+        int fd = socket(AF_INET, types[i] | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+            return false;
+        int one = 1;
+        if (types[i] == SOCK_STREAM)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+        bool bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        close(fd);
+        if (!bound)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * matrix_ports: Finds the two ports of a game, port and port + 1, from the configured port on.
+ *               A pair with a port that is in use (EADDRINUSE) is skipped for the next pair.
+ * @return The first port, or -1 if MATRIX_PORT_TRIES pairs were all in use.
+ */
+int matrix_ports(int port)
+{
+    for (int i = 0; i < MATRIX_PORT_TRIES && port + 1 < 65536; i++, port += 2)
+    {
+        if (matrix_port_free(port) && matrix_port_free(port + 1))
+            return port;
+    }
+    return -1;
+}
+
+/**
+ * matrix_open: Opens a socket to a topology endpoint given in mync's client syntax, TCPC or
+ *              UDPC host,port or UDSCS, UDSCD or UDSCP path. A UDS datagram socket gets a name
+ *              of its own and sends an empty datagram, so that the server learns where to reply.
+ * @param protocol: Receives IPPROTO_TCP, IPPROTO_UDP, or 0 for a UDS endpoint.
+ * @return The connected socket, or -1 with errno set.
+ */
+int matrix_open(const char *endpoint, int *protocol)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int domain = AF_INET;
+    int type = SOCK_STREAM;
+    memset(&addr, 0, sizeof(addr));
+    *protocol = 0;
+    if (strncmp(endpoint, "TCPC", 4) == 0 || strncmp(endpoint, "UDPC", 4) == 0)
+    {
+        char host[MATRIX_ARG_SIZE];
+        snprintf(host, sizeof(host), "%s", endpoint + 4);
+        char *comma = strchr(host, ',');
+        if (comma == NULL)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        *comma = '\0';
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(atoi(comma + 1));
+        struct hostent *entry = gethostbyname(host);
+        if (entry == NULL || entry->h_addrtype != AF_INET)
+        {
+            errno = EHOSTUNREACH;
+            return -1;
+        }
+        memcpy(&in->sin_addr, entry->h_addr_list[0], sizeof(in->sin_addr));
+        addr_len = sizeof(*in);
+        *protocol = endpoint[0] == 'T' ? IPPROTO_TCP : IPPROTO_UDP;
+        if (*protocol == IPPROTO_UDP)
+            type = SOCK_DGRAM;
+    }
+    else if (strncmp(endpoint, "UDSC", 4) == 0 && endpoint[4] != '\0')
+    {
+        struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+        const char *path = endpoint + 5;
+        un->sun_family = AF_UNIX;
+        strncpy(un->sun_path, path, sizeof(un->sun_path) - 1);
+        addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+        // "@name" is an abstract address, its name starts with a null byte
+        if (path[0] == '@')
+            un->sun_path[0] = '\0';
+        else
+            addr_len++;
+        domain = AF_UNIX;
+        if (endpoint[4] == 'D')
+            type = SOCK_DGRAM;
+        else if (endpoint[4] == 'P')
+            type = SOCK_SEQPACKET;
+    }
+    else
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = socket(domain, type | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    sa_family_t family = AF_UNIX;
+    if ((domain == AF_UNIX && type == SOCK_DGRAM && bind(fd, (struct sockaddr *)&family, sizeof(family)) == -1) ||
+        connect(fd, (struct sockaddr *)&addr, addr_len) == -1 ||
+        (domain == AF_UNIX && type == SOCK_DGRAM && send(fd, "", 0, 0) == -1))
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * matrix_connect: Connects to a topology endpoint, retrying while its process is starting up.
+ * @return The connected socket, or -1 if it did not come up in time.
+ */
+int matrix_connect(const char *pattern, const char *ttt_command, int port, const char *uds, int *protocol)
+{
+    char endpoint[MATRIX_ARG_SIZE];
+    matrix_expand(pattern, endpoint, ttt_command, port, uds);
+    uint64_t deadline = monotonic_ns() + MATRIX_READY_NS;
+    while (true)
+    {
+        int fd = matrix_open(endpoint, protocol);
+        if (fd != -1 || monotonic_ns() >= deadline)
+            return fd;
+        struct timespec delay = {0, (long)MATRIX_RETRY_NS};
+        nanosleep(&delay, NULL);
+    }
+}
+
+/**
+ * matrix_listen: Opens the TCP listener that a chain topology sends the board to.
+ * @return The listening socket, or -1 on failure.
+ */
+int matrix_listen(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 1) == -1)
+    {
+        perror("error listening for the board");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * matrix_ready: Waits until a process logs its ready line on the pipe of its stderr, which it
+ *               does once its endpoint is open: a datagram sent earlier would be lost, and with
+ *               -R its retransmission timeout would count as session setup.
+ * @return 0 once the line was logged, -1 if the process exited or did not get ready in time.
+ */
+int matrix_ready(int fd, const char *line)
+{
+    char log[MATRIX_TRANSCRIPT_SIZE];
+    size_t length = 0;
+    uint64_t deadline = monotonic_ns() + MATRIX_READY_NS;
+    while (true)
+    {
+        uint64_t now = monotonic_ns();
+        if (now >= deadline)
+            return -1;
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000)) <= 0)
+            continue;
+        ssize_t size = read(fd, log + length, sizeof(log) - 1 - length);
+        if (size == -1 && errno == EINTR)
+            continue;
+        if (size <= 0)
+            return -1;
+        length += size;
+        log[length] = '\0';
+        if (strstr(log, line) != NULL)
+            return 0;
+        // Keep the last line, which may not be complete yet
+        char *last = strrchr(log, '\n');
+        if (last != NULL)
+        {
+            length = log + length - (last + 1);
+            memmove(log, last + 1, length);
+        }
+        if (length == sizeof(log) - 1)
+            length = 0;
+    }
+}
+
+/**
+ * matrix_spawn: Starts one mync of a topology in its own process group, so that ending the game
+ *               also ends the ttt it runs. Its stdin, stdout and stderr are the given fds, or
+ *               /dev/null for -1. The harness opens all its other fds with O_CLOEXEC, so only
+ *               stdio reaches the topology.
+ */
+pid_t matrix_spawn(const char *mync, const char *const *args, const char *ttt_command, int port, const char *uds,
+                   int stdin_fd, int stdout_fd, int stderr_fd)
+{
+    static char expanded[MATRIX_MAX_ARGS][MATRIX_ARG_SIZE];
+    char *argv[MATRIX_MAX_ARGS + 2];
+    int argc = 0;
+    argv[argc++] = (char *)mync;
+    for (int i = 0; i < MATRIX_MAX_ARGS && args[i] != NULL; i++)
+    {
+        matrix_expand(args[i], expanded[i], ttt_command, port, uds);
+        argv[argc++] = expanded[i];
+    }
+    argv[argc] = NULL;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    // Both sides set the group, so it is in place whichever runs first
+    if (pid > 0)
+        setpgid(pid, pid);
+    if (pid != 0)
+        return pid;
+    setpgid(0, 0);
+    int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    dup2(stdin_fd != -1 ? stdin_fd : null_fd, STDIN_FILENO);
+    dup2(stdout_fd != -1 ? stdout_fd : null_fd, STDOUT_FILENO);
+    dup2(stderr_fd != -1 ? stderr_fd : null_fd, STDERR_FILENO);
+    execv(mync, argv);
+    _exit(EXIT_FAILURE);
+}
+
+/**
+ * matrix_find: Finds the first prompt or end of game in the transcript after from.
+ * @param end: Receives the offset after the match.
+ * @return 1 for a prompt, 2 for the end of the game, 0 if there is neither.
+ */
+int matrix_find(const char *transcript, size_t length, size_t from, size_t *end)
+{
+    static const char *const patterns[4] = {MATRIX_PROMPT, "I Win", "I lost", "DRAW"};
+    const char *first = NULL;
+    int found = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        const char *match = (const char *)memmem(transcript + from, length - from, patterns[i], strlen(patterns[i]));
+        if (match != NULL && (first == NULL || match < first))
+        {
+            first = match;
+            found = i == 0 ? 1 : 2;
+            *end = match - transcript + strlen(patterns[i]);
+        }
+    }
+    return found;
+}
+
+/**
+ * matrix_play: Starts a topology and plays one game through it.
+ *              Session setup is timed from the harness's connection, or from the start of the
+ *              last process when it only talks over pipes, to the first prompt. A move is timed
+ *              from its write to the next prompt or the end of the game, and the game from the
+ *              start of session setup to its end.
+ * @return 0 on success, -1 if the game did not complete.
+ */
+int matrix_play(const struct matrix_config *config, const struct matrix_topology *topology, const char *moves, int index,
+                int port, struct matrix_result *result)
+{
+    char ttt_command[MATRIX_ARG_SIZE];
+    char uds[MATRIX_ARG_SIZE];
+    snprintf(ttt_command, sizeof(ttt_command), "%s %s", config->ttt, config->sequence);
+    snprintf(uds, sizeof(uds), "@mync_matrix_%d_%d", (int)getpid(), index);
+
+    int nstages = topology->args[1][0] != NULL ? 2 : 1;
+    pid_t pids[MATRIX_MAX_STAGES] = {-1, -1};
+    int stdin_pipe[2] = {-1, -1};
+    int stdout_pipe[2] = {-1, -1};
+    // The first process's log, kept open and drained until the game ends so it never blocks
+    int log_pipe[2] = {-1, -1};
+    int listener = -1;
+    int moves_fd = -1;
+    int board_fd = -1;
+    int sock = -1;
+    int status = -1;
+    if ((topology->moves == MATRIX_PIPE && pipe2(stdin_pipe, O_CLOEXEC) == -1) ||
+        (topology->board == MATRIX_PIPE && pipe2(stdout_pipe, O_CLOEXEC) == -1) ||
+        (topology->ready != NULL && pipe2(log_pipe, O_CLOEXEC) == -1))
+    {
+        perror("pipe");
+        goto done;
+    }
+    if (topology->board == MATRIX_LISTEN && (listener = matrix_listen(port + 1)) == -1)
+        goto done;
+
+    for (int stage = 0; stage < nstages; stage++)
+    {
+        bool last = stage == nstages - 1;
+        pids[stage] = matrix_spawn(config->mync, topology->args[stage], ttt_command, port, uds, last ? stdin_pipe[0] : -1,
+                                   last ? stdout_pipe[1] : -1, stage == 0 ? log_pipe[1] : -1);
+        if (pids[stage] == -1)
+        {
+            perror("fork");
+            goto done;
+        }
+        if (stage == 0 && log_pipe[1] != -1)
+        {
+            close(log_pipe[1]);
+            log_pipe[1] = -1;
+        }
+        if (!last && topology->ready != NULL && matrix_ready(log_pipe[0], topology->ready) == -1)
+            goto done;
+    }
+    if (stdin_pipe[0] != -1)
+        close(stdin_pipe[0]);
+    if (stdout_pipe[1] != -1)
+        close(stdout_pipe[1]);
+    stdin_pipe[0] = stdout_pipe[1] = -1;
+
+    {
+        uint64_t start_ns = monotonic_ns();
+        int protocol = -1;
+        if (topology->endpoint != NULL)
+        {
+            sock = matrix_connect(topology->endpoint, ttt_command, port, uds, &protocol);
+            if (sock == -1)
+                goto done;
+            start_ns = monotonic_ns();
+        }
+        // ttt writes a board in several small writes, which Nagle holds back on the far side
+        // until the bot ACKs. The bot ACKs at once instead of delaying, so a move is not timed
+        // with a 40 ms delayed ACK that no interactive player would see.
+        bool quickack = protocol == IPPROTO_TCP && topology->board == MATRIX_CONNECT;
+        int one = 1;
+        if (protocol == IPPROTO_TCP)
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        moves_fd = topology->moves == MATRIX_PIPE ? stdin_pipe[1] : sock;
+        board_fd = topology->board == MATRIX_PIPE ? stdout_pipe[0] : topology->board == MATRIX_CONNECT ? sock : -1;
+        // A UDP session starts with the client's first datagram, a newline that ttt skips
+        bool hello = topology->board == MATRIX_CONNECT && protocol == IPPROTO_UDP;
+        uint64_t hello_ns = 0;
+
+        static char transcript[MATRIX_TRANSCRIPT_SIZE];
+        size_t length = 0;
+        size_t scanned = 0;
+        bool ready = false;
+        uint64_t move_ns = 0;
+        size_t move = 0;
+        uint64_t deadline = start_ns + (uint64_t)(config->timeout * 1e9);
+        while (true)
+        {
+            uint64_t now = monotonic_ns();
+            if (now >= deadline)
+                goto done;
+            if (hello && !ready && now >= hello_ns + MATRIX_RETRY_NS)
+            {
+                send(sock, "\n", 1, MSG_NOSIGNAL);
+                hello_ns = now;
+            }
+            struct pollfd pfds[2];
+            pfds[0].fd = board_fd != -1 ? board_fd : listener;
+            pfds[0].events = POLLIN;
+            pfds[1].fd = log_pipe[0];
+            pfds[1].events = POLLIN;
+            uint64_t wait_ns = hello && !ready ? MATRIX_RETRY_NS : deadline - now;
+            if (poll(pfds, 2, (int)((wait_ns + 999999) / 1000000)) <= 0)
+                continue;
+            if (pfds[1].revents)
+            {
+                char drain[4096];
+                if (read(log_pipe[0], drain, sizeof(drain)) <= 0)
+                {
+                    close(log_pipe[0]);
+                    log_pipe[0] = -1;
+                }
+            }
+            if (pfds[0].revents == 0)
+                continue;
+            if (board_fd == -1)
+            {
+                board_fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+                continue;
+            }
+
+            // Keep the end of a long transcript, a match never spans more than a prompt
+            if (length > sizeof(transcript) / 2)
+            {
+                size_t keep = sizeof(MATRIX_PROMPT);
+                memmove(transcript, transcript + length - keep, keep);
+                scanned = scanned > length - keep ? scanned - (length - keep) : 0;
+                length = keep;
+            }
+            ssize_t size = read(board_fd, transcript + length, sizeof(transcript) - length);
+            now = monotonic_ns();
+            // TCP_QUICKACK does not stick, it is set again after every read
+            if (quickack)
+                setsockopt(board_fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+            if (size == -1 && errno == ECONNREFUSED && hello && !ready)
+            {
+                // The server was not up yet, setup starts with the hello that reaches it
+                start_ns = now;
+                continue;
+            }
+            if (size == -1 && errno == EINTR)
+                continue;
+            if (size <= 0)
+                goto done;
+            length += size;
+
+            size_t end;
+            int found;
+            while ((found = matrix_find(transcript, length, scanned, &end)) != 0)
+            {
+                scanned = end;
+                if (ready && move_ns != 0)
+                    latency_record(&result->move, now - move_ns);
+                move_ns = 0;
+                if (found == 2)
+                {
+                    latency_record(&result->game, now - start_ns);
+                    status = 0;
+                    goto done;
+                }
+                if (!ready)
+                {
+                    latency_record(&result->setup, now - start_ns);
+                    ready = true;
+                }
+                if (moves[move] == '\0')
+                    goto done;
+                char line[2] = {moves[move++], '\n'};
+                move_ns = monotonic_ns();
+                if (write_all(moves_fd, line, sizeof(line)) == -1)
+                    goto done;
+            }
+            if (length - scanned >= sizeof(MATRIX_PROMPT))
+                scanned = length - sizeof(MATRIX_PROMPT) + 1;
+        }
+    }
+
+done:
+    int fds[] = {stdin_pipe[0], stdin_pipe[1], stdout_pipe[0], stdout_pipe[1], log_pipe[0], log_pipe[1], listener, sock};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+    {
+        if (fds[i] != -1)
+            close(fds[i]);
+    }
+    if (board_fd != -1 && board_fd != sock && board_fd != stdout_pipe[0])
+        close(board_fd);
+    // The whole group goes, a ttt that outlives its mync would still hold the endpoint
+    for (int stage = nstages - 1; stage >= 0; stage--)
+    {
+        if (pids[stage] <= 0)
+            continue;
+        kill(-pids[stage], SIGTERM);
+        while (waitpid(-pids[stage], NULL, 0) > 0 || errno == EINTR)
+            ;
+    }
+    return status;
+}
+
+/**
+ * main: Plays ttt games through every topology and prints one line of session setup, move and
+ *       game latencies per topology, appending the same figures to a CSV file when one is given
+ *       so that releases can be compared.
+ */
+int main(int argc, char *argv[])
+{
+    struct matrix_config config;
+    if (argc > 2 || parse_matrix_config(argc == 2 ? argv[1] : NULL, &config) == -1)
+    {
+        fprintf(stderr, "Usage: %s [games=N,mync=path,ttt=path,sequence=digits,port=N,only=name,timeout=seconds,csv=file,label=text]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    // Orphaned ttt processes are reaped here, see matrix_play()
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+    char moves[5];
+    matrix_script(config.sequence, moves);
+    printf("Matrix: %d games per topology, ttt %s, bot moves %s\n", config.games, config.sequence, moves);
+    printf("%-14s %5s %6s %10s %10s %10s %10s %10s %10s %10s\n", "topology", "games", "errors", "setup p50",
+           "setup p99", "move p50", "move p90", "move p99", "game p50", "game p99");
+
+    FILE *csv = NULL;
+    if (config.csv != NULL)
+    {
+        csv = fopen(config.csv, "a");
+        if (csv == NULL)
+        {
+            perror("error opening the CSV report");
+            return EXIT_FAILURE;
+        }
+        if (ftell(csv) == 0)
+            fprintf(csv, "label,topology,games,errors,setup_p50_us,setup_p99_us,move_p50_us,move_p90_us,move_p99_us,move_max_us,game_p50_us,game_p99_us\n");
+    }
+
+    int errors = 0;
+    struct matrix_result *result = (struct matrix_result *)malloc(sizeof(struct matrix_result));
+    if (result == NULL)
+    {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    for (size_t t = 0; t < sizeof(matrix_topologies) / sizeof(matrix_topologies[0]); t++)
+    {
+        const struct matrix_topology *topology = &matrix_topologies[t];
+        if (config.only != NULL && strcmp(config.only, topology->name) != 0)
+            continue;
+        memset(result, 0, sizeof(*result));
+        for (int game = 0; game < config.games; game++)
+        {
+            int port = matrix_ports(config.port);
+            if (port == -1)
+            {
+                fprintf(stderr, "No free pair of ports from %d on\n", config.port);
+                result->errors++;
+                continue;
+            }
+            if (matrix_play(&config, topology, moves, (int)t, port, result) == 0)
+                result->games++;
+            else
+                result->errors++;
+        }
+        errors += result->errors;
+
+        double figures[8] = {
+            latency_percentile(&result->setup, 0.50) / 1000.0, latency_percentile(&result->setup, 0.99) / 1000.0,
+            latency_percentile(&result->move, 0.50) / 1000.0, latency_percentile(&result->move, 0.90) / 1000.0,
+            latency_percentile(&result->move, 0.99) / 1000.0, result->move.max / 1000.0,
+            latency_percentile(&result->game, 0.50) / 1000.0, latency_percentile(&result->game, 0.99) / 1000.0};
+        printf("%-14s %5d %6d %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", topology->name, result->games,
+               result->errors, figures[0], figures[1], figures[2], figures[3], figures[4], figures[6], figures[7]);
+        fflush(stdout);
+        if (csv != NULL)
+            fprintf(csv, "%s,%s,%d,%d,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", config.label, topology->name,
+                    result->games, result->errors, figures[0], figures[1], figures[2], figures[3], figures[4],
+                    figures[5], figures[6], figures[7]);
+    }
+    printf("Latencies in us, session setup to the first prompt, a move to the next prompt\n");
+    free(result);
+    if (csv != NULL)
+        fclose(csv);
+    return errors > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <stdbool.h>
 #include <signal.h>
 #include <sys/wait.h>
@@ -10,14 +11,282 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <endian.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <unordered_map>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <atomic>
 
 #define MAX_FILEPATH 256
+#define MYNC_OPTIONS "e:t:i:o:b:a:w:c:r:L:s:vl:H:z:P:T:F:m:R"
 // Global variables to hold socket file descriptors
 int input_fd = STDIN_FILENO;
 int output_fd = STDOUT_FILENO;
 
 int child = 0;
 
+#define LOG_SLOTS 1024
+#define LOG_RECORD_SIZE 256
+#define LOG_FLUSH_INTERVAL_NS 10000000
+#define LOG_EXIT_WAIT_NS 1000000000
+
+enum log_levels
+{
+    LOG_LEVEL_OFF,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+};
+
+// Diagnostics are only formatted when their level is enabled, -v raises the level
+#define LOG(level, ...)                          \
+    do                                           \
+    {                                            \
+        if ((level) <= log_level)                \
+            log_write((level), __VA_ARGS__);     \
+    } while (0)
+#define LOG_INFO(...) LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+/**
+ * A slot of the log ring. sequence tells producers and the consumer whose turn it is:
+ * it equals the enqueue position when the slot is free and that position + 1 once the
+ * record in it is complete (a bounded multi-producer queue, no locks on the write side).
+ */
+struct log_slot
+{
+    std::atomic<uint64_t> sequence;
+    size_t length;
+    char text[LOG_RECORD_SIZE];
+};
+
+int log_level = LOG_LEVEL_OFF;
+int log_fd = STDERR_FILENO;
+pid_t log_pid = 0;
+struct log_slot log_slots[LOG_SLOTS];
+std::atomic<uint64_t> log_enqueue_pos(0);
+std::atomic<uint64_t> log_dropped(0);
+std::atomic<bool> log_flusher_running(false);
+std::atomic<bool> log_flusher_stop(false);
+pthread_t log_flusher_thread;
+// Only taken by whoever drains the ring: the flusher thread, exit and fork
+pthread_mutex_t log_consumer_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t log_dequeue_pos = 0;
+
+/**
+ * monotonic_ns: Returns CLOCK_MONOTONIC in nanoseconds (served by the vDSO, no syscall).
+ */
+uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * write_all: Writes a whole buffer, retrying after partial writes and interrupts.
+ * @return 0 on success, -1 on failure.
+ */
+int write_all(int fd, const char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, buffer, length);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/**
+ * log_flush_locked: Writes all complete records to the log fd. The caller holds log_consumer_lock.
+ */
+void log_flush_locked()
+{
+    char buffer[16 * LOG_RECORD_SIZE];
+    while (true)
+    {
+        size_t used = 0;
+        while (used + LOG_RECORD_SIZE <= sizeof(buffer))
+        {
+            struct log_slot *slot = &log_slots[log_dequeue_pos % LOG_SLOTS];
+            if (slot->sequence.load(std::memory_order_acquire) != log_dequeue_pos + 1)
+                break;
+            memcpy(buffer + used, slot->text, slot->length);
+            used += slot->length;
+            slot->sequence.store(log_dequeue_pos + LOG_SLOTS, std::memory_order_release);
+            log_dequeue_pos++;
+        }
+        uint64_t dropped = log_dropped.exchange(0);
+        if (dropped > 0)
+            used += snprintf(buffer + used, sizeof(buffer) - used, "%llu log records dropped\n", (unsigned long long)dropped);
+        if (used == 0)
+            break;
+        write_all(log_fd, buffer, used);
+    }
+}
+
+/**
+ * log_flush: Writes the pending records now. Used before exec() and exit(): the flusher thread
+ *            is stopped and joined first, then the ring is drained. The lock is only waited
+ *            for up to LOG_EXIT_WAIT_NS, in case exit() runs in a signal handler that
+ *            interrupted its holder.
+ */
+void log_flush()
+{
+    if (log_level == LOG_LEVEL_OFF)
+        return;
+    if (log_flusher_running.load() && !pthread_equal(pthread_self(), log_flusher_thread))
+    {
+        log_flusher_stop = true;
+        pthread_join(log_flusher_thread, NULL);
+        log_flusher_stop = false;
+        log_flusher_running = false;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += LOG_EXIT_WAIT_NS / 1000000000;
+    if (pthread_mutex_timedlock(&log_consumer_lock, &deadline) != 0)
+        return;
+    log_flush_locked();
+    pthread_mutex_unlock(&log_consumer_lock);
+}
+
+void *log_flusher(void *)
+{
+    struct timespec interval;
+    interval.tv_sec = 0;
+    interval.tv_nsec = LOG_FLUSH_INTERVAL_NS;
+    while (!log_flusher_stop.load())
+    {
+        pthread_mutex_lock(&log_consumer_lock);
+        log_flush_locked();
+        pthread_mutex_unlock(&log_consumer_lock);
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * log_write: Formats a record into the next free slot of the ring, the flusher thread writes
+ *            it out later. When the ring is full the record is counted as dropped rather than
+ *            making the caller wait. Use the LOG_* macros instead of calling it directly.
+ */
+void log_write(int level, const char *format, ...)
+{
+    static const char *const names[] = {"", "INFO", "DEBUG"};
+
+    // A forked child has no flusher thread until it logs for the first time
+    bool expected = false;
+    if (!log_flusher_running.load(std::memory_order_relaxed) &&
+        log_flusher_running.compare_exchange_strong(expected, true))
+    {
+        if (pthread_create(&log_flusher_thread, NULL, log_flusher, NULL) != 0)
+            log_flusher_running = false;
+    }
+
+    uint64_t pos = log_enqueue_pos.load(std::memory_order_relaxed);
+    struct log_slot *slot;
+    while (true)
+    {
+        slot = &log_slots[pos % LOG_SLOTS];
+        int64_t diff = (int64_t)slot->sequence.load(std::memory_order_acquire) - (int64_t)pos;
+        if (diff == 0 && log_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            break;
+        if (diff < 0)
+        {
+            log_dropped++;
+            return;
+        }
+        if (diff > 0)
+            pos = log_enqueue_pos.load(std::memory_order_relaxed);
+    }
+
+    uint64_t now = monotonic_ns();
+    int length = snprintf(slot->text, LOG_RECORD_SIZE, "[%llu.%06llu] %s mync[%d]: ",
+                          (unsigned long long)(now / 1000000000ull), (unsigned long long)(now % 1000000000ull / 1000),
+                          names[level], (int)log_pid);
+    va_list args;
+    va_start(args, format);
+    length += vsnprintf(slot->text + length, LOG_RECORD_SIZE - length, format, args);
+    va_end(args);
+    if (length > LOG_RECORD_SIZE - 1)
+        length = LOG_RECORD_SIZE - 1;
+    if (slot->text[length - 1] != '\n')
+        slot->text[length++] = '\n';
+    slot->length = length;
+    slot->sequence.store(pos + 1, std::memory_order_release);
+}
+
+void log_before_fork()
+{
+    // The child gets a copy of the ring, so it must be empty to not log records twice
+    pthread_mutex_lock(&log_consumer_lock);
+    log_flush_locked();
+}
+
+void log_after_fork_parent()
+{
+    pthread_mutex_unlock(&log_consumer_lock);
+}
+
+void log_after_fork_child()
+{
+    pthread_mutex_unlock(&log_consumer_lock);
+    log_flusher_running = false;
+    log_pid = getpid();
+}
+
+/**
+ * log_init: Sets the log level and destination. Nothing is logged at LOG_LEVEL_OFF.
+ * @param level: The most detailed level that is logged.
+ * @param path: A file the records are appended to, or NULL for stderr.
+ */
+void log_init(int level, const char *path)
+{
+    log_level = level > LOG_LEVEL_DEBUG ? LOG_LEVEL_DEBUG : level;
+    if (log_level == LOG_LEVEL_OFF)
+        return;
+    if (path != NULL)
+    {
+        log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (log_fd == -1)
+        {
+            perror("Failed to open log file");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (uint64_t i = 0; i < LOG_SLOTS; i++)
+        log_slots[i].sequence.store(i, std::memory_order_relaxed);
+    log_pid = getpid();
+    pthread_atfork(log_before_fork, log_after_fork_parent, log_after_fork_child);
+    atexit(log_flush);
+}
+
 /**
  * @brief Close the open socket file descriptors.
  *
@@ -76,7 +345,8 @@ void executeCommand(const char *command)
     // If a command is given, execute it using the shell
     if (command)
     {
-        // Execute the command using the shell
+        // Execute the command using the shell, exec() discards the records that were not written yet
+        log_flush();
         execl("/bin/sh", "sh", "-c", command, nullptr);
 
         // If the command execution fails, print an error message and exit with failure
@@ -107,12 +377,13 @@ void chat_stdin_to_stdout()
 }
 
 /**
- * start_tcp_server: Creates a TCP server socket, sets socket options, binds the socket to a port,
- *                  and starts listening for incoming client connections.
+ * open_tcp_listener: Creates a TCP server socket, sets socket options, binds the socket to a port,
+ *                    and starts listening for incoming client connections.
  * @param port: The port number to listen on.
- * @return The client socket file descriptor, or -1 if an error occurred.
+ * @param backlog: The length of the queue of pending connections.
+ * @return The listening socket file descriptor, or -1 if an error occurred.
  */
-int start_tcp_server(int port)
+int open_tcp_listener(int port, int backlog)
 {
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd == -1)
@@ -141,13 +412,29 @@ int start_tcp_server(int port)
         return -1;
     }
 
-    if (listen(server_fd, 1) == -1)
+    if (listen(server_fd, backlog) == -1)
     {
         perror("Failed to listen on server socket");
         close(server_fd);
         return -1;
     }
 
+    return server_fd;
+}
+
+/**
+ * start_tcp_server: Opens a TCP listener on a port and waits for one client connection.
+ * @param port: The port number to listen on.
+ * @return The client socket file descriptor, or -1 if an error occurred.
+ */
+int start_tcp_server(int port)
+{
+    int server_fd = open_tcp_listener(port, 1);
+    if (server_fd == -1)
+    {
+        return -1;
+    }
+
     struct sockaddr_in client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
     int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
@@ -162,49 +449,93 @@ int start_tcp_server(int port)
 }
 
 /**
- * start_tcp_client: Creates a TCP client socket and connects to a server.
+ * resolve_ipv4: Resolves a hostname or dotted IPv4 address.
+ * @param hostname: The hostname or address, NULL or "localhost" for the loopback address.
+ * @param addr: Receives the address.
+ * @return 0 on success, -1 if the name cannot be resolved.
+ */
+int resolve_ipv4(const char *hostname, struct in_addr *addr)
+{
+    if (hostname == NULL || *hostname == '\0' || strcmp(hostname, "localhost") == 0)
+    {
+        addr->s_addr = htonl(INADDR_LOOPBACK);
+        return 0;
+    }
+    if (inet_pton(AF_INET, hostname, addr) == 1)
+    {
+        return 0;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    struct addrinfo *result;
+    if (getaddrinfo(hostname, NULL, &hints, &result) != 0)
+    {
+        return -1;
+    }
+    *addr = ((struct sockaddr_in *)result->ai_addr)->sin_addr;
+    freeaddrinfo(result);
+    return 0;
+}
+
+/**
+ * connect_tcp: Creates a TCP socket and connects it to a server, without exiting on failure.
  * @param hostname: The hostname or IP address of the server.
  * @param port: The port number of the server.
+ * @return The connected socket, or -1 on failure with errno set.
  */
-int start_tcp_client(const char *hostname, int port)
+int connect_tcp(const char *hostname, int port)
 {
     int client_fd;
     // Create a TCP client socket.
     if ((client_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-    {
-        perror("Socket creation error"); // Print an error message if socket creation fails.
-        exit(EXIT_FAILURE);              // Exit with a failure status.
-    }
-    printf("Socket created\n"); // Print a message indicating that the socket was created.
+        return -1;
+    LOG_DEBUG("Socket created\n"); // Print a message indicating that the socket was created.
 
     // Set up the server address structure.
     struct sockaddr_in serv_addr;
     serv_addr.sin_family = AF_INET;   // Set the address family to AF_INET (IPv4).
     serv_addr.sin_port = htons(port); // Set the server port.
 
-    if (!(strcmp(hostname, "127.0.0.1")))
+    // Resolve the hostname to an IPv4 address.
+    if (resolve_ipv4(hostname, &serv_addr.sin_addr) == -1)
     {
-        // Check if the hostname is a valid IP address.
-        if (inet_pton(AF_INET, hostname, &serv_addr.sin_addr) <= 0)
-        {
-            perror("Invalid address/ Address not supported"); // Print an error message if the hostname is invalid.
-            close(client_fd);                                 // Close the client socket.
-            exit(EXIT_FAILURE);                               // Exit with a failure status.
-        }
-        printf("Server address set to %s\n", hostname);
+        fprintf(stderr, "Invalid address/ Address not supported: %s\n", hostname); // Print an error message if the hostname is invalid.
+        close(client_fd);                                                          // Close the client socket.
+        errno = EINVAL;
+        return -1;
     }
+    LOG_DEBUG("Server address set to %s\n", inet_ntoa(serv_addr.sin_addr));
 
     // Print a message indicating that the client is connecting to the server.
-    printf("Connecting to %s:%d\n", hostname ?: "localhost", port);
+    LOG_DEBUG("Connecting to %s:%d\n", hostname ?: "localhost", port);
 
     // Connect the client socket to the server.
     if (connect(client_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    {
+        int saved_errno = errno;
+        close(client_fd); // Close the client socket.
+        errno = saved_errno;
+        return -1;
+    }
+    return client_fd;
+}
+
+/**
+ * start_tcp_client: Creates a TCP client socket and connects to a server.
+ * @param hostname: The hostname or IP address of the server.
+ * @param port: The port number of the server.
+ */
+int start_tcp_client(const char *hostname, int port)
+{
+    int client_fd = connect_tcp(hostname, port);
+    if (client_fd == -1)
     {
         perror("Connection failed"); // Print an error message if the connection fails.
-        close(client_fd);            // Close the client socket.
         exit(EXIT_FAILURE);          // Exit with a failure status.
     }
-    printf("Connected to %s:%d\n", hostname ?: "localhost", port);
+    LOG_INFO("Connected to %s:%d\n", hostname ?: "localhost", port);
 
     return client_fd;
 }
@@ -217,7 +548,7 @@ int start_udp_server(int port)
         perror("socket failed");
         exit(EXIT_FAILURE);
     }
-    printf("UDP server socket created\n");
+    LOG_DEBUG("UDP server socket created\n");
 
     // Set the socket options to reuse the address
     int opt = 1;
@@ -227,7 +558,7 @@ int start_udp_server(int port)
         close(server_fd);
         exit(EXIT_FAILURE);
     }
-    printf("UDP server socket options set\n");
+    LOG_DEBUG("UDP server socket options set\n");
 
     struct sockaddr_in address;
     address.sin_family = AF_INET;
@@ -240,7 +571,7 @@ int start_udp_server(int port)
         close(server_fd);
         exit(EXIT_FAILURE);
     }
-    printf("UDP server socket bound to port %d\n", port);
+    LOG_INFO("UDP server socket bound to port %d\n", port);
     return server_fd;
 }
 
@@ -258,26 +589,71 @@ int start_udp_client(const char *hostname, int port)
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_port = htons(port);
 
-    if (!(strcmp(hostname, "127.0.0.1")))
+    if (resolve_ipv4(hostname, &serv_addr.sin_addr) == -1)
     {
-        if (inet_pton(AF_INET, hostname, &serv_addr.sin_addr) <= 0)
-        {
-            perror("Invalid address/ Address not supported");
-            close(client_fd);
-            exit(EXIT_FAILURE);
-        }
+        fprintf(stderr, "Invalid address/ Address not supported: %s\n", hostname);
+        close(client_fd);
+        exit(EXIT_FAILURE);
     }
 
     // sendto(client_fd, buffer, strlen(buffer), MSG_CONFIRM, (const struct sockaddr *)&serv_addr, sizeof(serv_addr));
     connect(client_fd, (const struct sockaddr *)&serv_addr, sizeof(serv_addr));
-    printf("Message sent\n");
+    LOG_DEBUG("Message sent\n");
 
     return client_fd;
 }
 
+/**
+ * fill_uds_address: Fills a Unix domain socket address from a path.
+ *                   A path starting with '@' names a socket in the Linux abstract namespace,
+ *                   which has no filesystem inode and disappears with its last descriptor.
+ * @param path: The socket path, or "@name" for an abstract address.
+ * @param addr: The address structure to fill.
+ * @return The address length to pass to bind() or connect().
+ */
+socklen_t fill_uds_address(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path[0] == '@')
+    {
+        // Abstract names start with a NUL byte and their length is given by the address length
+        size_t len = strnlen(path + 1, sizeof(addr->sun_path) - 1);
+        memcpy(addr->sun_path + 1, path + 1, len);
+        return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+    }
+    strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+    return sizeof(*addr);
+}
+
+/**
+ * bind_uds_socket: Binds a Unix domain socket to a path or abstract name.
+ *                  Only filesystem paths are unlinked first, abstract names have nothing to remove.
+ * @param sockfd: The socket to bind.
+ * @param path: The socket path, or "@name" for an abstract address.
+ * @return 0 on success, -1 on failure.
+ */
+int bind_uds_socket(int sockfd, const char *path)
+{
+    struct sockaddr_un addr;
+    socklen_t addr_len = fill_uds_address(path, &addr);
+    if (path[0] != '@')
+    {
+        unlink(addr.sun_path);
+    }
+    return bind(sockfd, (struct sockaddr *)&addr, addr_len);
+}
+
+/**
+ * start_uds_server_datagram: Creates a datagram UDS server and ties it to the first peer that sends to it.
+ *                            The first datagram is only peeked, so no payload is lost, and the socket is then
+ *                            connected to the peer's address so that writes are sent back as replies.
+ * @param path: The socket path, or "@name" for an abstract address.
+ * @return The socket file descriptor.
+ */
 int start_uds_server_datagram(char *path)
 {
-    printf("Starting UDS server\n");
+    LOG_DEBUG("Starting UDS server\n");
     // create a socket
     int sockfd = socket(AF_UNIX, SOCK_DGRAM, 0);
     if (sockfd == -1)
@@ -285,60 +661,92 @@ int start_uds_server_datagram(char *path)
         perror("error creating socket");
         closeResourcesAndExit(EXIT_FAILURE);
     }
-    printf("Socket created\n");
+    LOG_DEBUG("Socket created\n");
     // bind the socket to the address
-    struct sockaddr_un addr;
-    addr.sun_family = AF_UNIX;
-    strcpy(addr.sun_path, path);
-    unlink(addr.sun_path);
-    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    if (bind_uds_socket(sockfd, path) == -1)
     {
-        printf("%s\n", addr.sun_path);
+        fprintf(stderr, "%s\n", path);
         perror("error binding socket");
         closeResourcesAndExit(EXIT_FAILURE);
     }
-    printf("Socket bound\n");
-    // receive dummy data to get the client address
-    char buffer[1024];
+    LOG_DEBUG("Socket bound\n");
+    // peek at the first datagram to get the client address
+    char buffer[1];
     struct sockaddr_un client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
 
-    int bytes_received = recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&client_addr, &client_addr_len);
+    int bytes_received = recvfrom(sockfd, buffer, sizeof(buffer), MSG_PEEK | MSG_TRUNC, (struct sockaddr *)&client_addr, &client_addr_len);
     if (bytes_received == -1)
     {
         perror("error receiving data");
         closeResourcesAndExit(EXIT_FAILURE);
     }
-    printf("Received data from client: %s\n", buffer);
+    // An empty datagram is the client's hello, it carries no data for the session
+    if (bytes_received == 0)
+    {
+        recv(sockfd, buffer, sizeof(buffer), 0);
+    }
+    if (client_addr_len <= sizeof(sa_family_t))
+    {
+        fprintf(stderr, "UDS client has no address, replies are not possible\n");
+        return sockfd;
+    }
+    if (connect(sockfd, (struct sockaddr *)&client_addr, client_addr_len) == -1)
+    {
+        perror("error connecting to client");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    LOG_INFO("Received data from client, replies go to the client address\n");
     return sockfd;
 }
 
-int start_uds_server_stream(char *path)
+/**
+ * open_uds_listener: Creates a connection-oriented UDS socket, binds it and starts listening.
+ * @param path: The socket path, or "@name" for an abstract address.
+ * @param type: SOCK_STREAM for a byte stream, or SOCK_SEQPACKET to keep message boundaries.
+ * @param backlog: The length of the queue of pending connections.
+ * @return The listening socket file descriptor, or -1 if an error occurred.
+ */
+int open_uds_listener(const char *path, int type, int backlog)
 {
-    printf("Starting UDS server\n");
-    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    int sockfd = socket(AF_UNIX, type, 0);
     if (sockfd == -1)
     {
         perror("error creating socket");
-        closeResourcesAndExit(EXIT_FAILURE);
+        return -1;
     }
-    printf("Socket created\n");
-    struct sockaddr_un addr;
-    addr.sun_family = AF_UNIX;
-    strcpy(addr.sun_path, path);
-    unlink(addr.sun_path);
-    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    LOG_DEBUG("Socket created\n");
+    if (bind_uds_socket(sockfd, path) == -1)
     {
         perror("error binding socket");
-        closeResourcesAndExit(EXIT_FAILURE);
+        close(sockfd);
+        return -1;
     }
-    printf("Socket bound\n");
-    if (listen(sockfd, 5) == -1)
+    LOG_DEBUG("Socket bound\n");
+    if (listen(sockfd, backlog) == -1)
     {
         perror("error listening");
+        close(sockfd);
+        return -1;
+    }
+    LOG_INFO("Listening for connections\n");
+    return sockfd;
+}
+
+/**
+ * start_uds_server_connected: Creates a connection-oriented UDS server and accepts one client.
+ * @param path: The socket path, or "@name" for an abstract address.
+ * @param type: SOCK_STREAM for a byte stream, or SOCK_SEQPACKET to keep message boundaries.
+ * @return The client socket file descriptor.
+ */
+int start_uds_server_connected(char *path, int type)
+{
+    LOG_DEBUG("Starting UDS server\n");
+    int sockfd = open_uds_listener(path, type, 5);
+    if (sockfd == -1)
+    {
         closeResourcesAndExit(EXIT_FAILURE);
     }
-    printf("Listening for connections\n");
     struct sockaddr_un client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
     int client_fd = accept(sockfd, (struct sockaddr *)&client_addr, &client_addr_len);
@@ -347,13 +755,30 @@ int start_uds_server_stream(char *path)
         perror("error accepting connection");
         closeResourcesAndExit(EXIT_FAILURE);
     }
-    printf("Connection accepted\n");
+    LOG_INFO("Connection accepted\n");
     return client_fd;
 }
 
+int start_uds_server_stream(char *path)
+{
+    return start_uds_server_connected(path, SOCK_STREAM);
+}
+
+int start_uds_server_seqpacket(char *path)
+{
+    return start_uds_server_connected(path, SOCK_SEQPACKET);
+}
+
+/**
+ * start_uds_client_datagram: Creates a datagram UDS client connected to a server.
+ *                            The client autobinds to an abstract address so the server can reply,
+ *                            and sends an empty hello datagram so the server learns that address.
+ * @param path: The socket path, or "@name" for an abstract address.
+ * @return The socket file descriptor.
+ */
 int start_uds_client_datagram(char *path)
 {
-    printf("Starting UDS client\n");
+    LOG_DEBUG("Starting UDS client\n");
     int sockfd = socket(AF_UNIX, SOCK_DGRAM, 0);
     if (sockfd == -1)
     {
@@ -361,25 +786,43 @@ int start_uds_client_datagram(char *path)
         closeResourcesAndExit(EXIT_FAILURE);
     }
 
+    // Binding with only the address family makes the kernel pick a unique abstract name
+    sa_family_t family = AF_UNIX;
+    if (bind(sockfd, (struct sockaddr *)&family, sizeof(family)) == -1)
+    {
+        perror("error binding socket");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+
     struct sockaddr_un addr;
-    addr.sun_family = AF_UNIX;
-    strcpy(addr.sun_path, path);
-    printf("Connecting to server\n");
-    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    socklen_t addr_len = fill_uds_address(path, &addr);
+    LOG_DEBUG("Connecting to server\n");
+    if (connect(sockfd, (struct sockaddr *)&addr, addr_len) == -1)
     {
         perror("error connecting to server");
         closeResourcesAndExit(EXIT_FAILURE);
     }
 
-    printf("Connected to server\n");
+    if (send(sockfd, "", 0, 0) == -1)
+    {
+        perror("error sending hello");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    LOG_INFO("Connected to server\n");
 
     return sockfd;
 }
 
-int start_uds_client_stream(char *path)
+/**
+ * start_uds_client_connected: Creates a connection-oriented UDS client and connects to a server.
+ * @param path: The socket path, or "@name" for an abstract address.
+ * @param type: SOCK_STREAM for a byte stream, or SOCK_SEQPACKET to keep message boundaries.
+ * @return The socket file descriptor.
+ */
+int start_uds_client_connected(char *path, int type)
 {
-    printf("Starting UDS client\n");
-    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    LOG_DEBUG("Starting UDS client\n");
+    int sockfd = socket(AF_UNIX, type, 0);
     if (sockfd == -1)
     {
         perror("error creating socket");
@@ -387,35 +830,116 @@ int start_uds_client_stream(char *path)
     }
 
     struct sockaddr_un addr;
-    addr.sun_family = AF_UNIX;
-    strcpy(addr.sun_path, path);
-    printf("Connecting to server\n");
-    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    socklen_t addr_len = fill_uds_address(path, &addr);
+    LOG_DEBUG("Connecting to server\n");
+    if (connect(sockfd, (struct sockaddr *)&addr, addr_len) == -1)
     {
         perror("error connecting to server");
         closeResourcesAndExit(EXIT_FAILURE);
     }
-    printf("Connected to server\n");
+    LOG_INFO("Connected to server\n");
     return sockfd;
 }
 
+int start_uds_client_stream(char *path)
+{
+    return start_uds_client_connected(path, SOCK_STREAM);
+}
+
+int start_uds_client_seqpacket(char *path)
+{
+    return start_uds_client_connected(path, SOCK_SEQPACKET);
+}
+
+// The FILE output endpoint, whose writes the relay gathers into large appends, and whether
+// they use O_DIRECT (FILE<path>,direct)
+int append_fd = -1;
+bool append_direct = false;
+// The FIFO input endpoint, the only pipe that is spliced (a command's pipes are not)
+int splice_fd = -1;
+
 /**
- * Update the input and output file descriptors
- * @param value the value to update the file descriptors
- * @param input_need_change 1 if the input file descriptor needs to be changed, 0 otherwise
- * @param output_need_change 1 if the output file descriptor needs to be changed, 0 otherwise
+ * open_file_endpoint: Opens a FILE endpoint. An input file is read from the start, an
+ *                     output file is created if needed and appended to.
+ * @param spec: The endpoint argument, FILE<path> or FILE<path>,direct for an output.
+ * @param flag: 'i' for an input, 'o' for an output.
+ * @return The file descriptor.
  */
-void configureInputOutput(bool tcp, bool udp, bool uds, bool server, bool client, int port, char *hostname, char *path, int change_in, int change_out)
+int open_file_endpoint(char *spec, char flag)
 {
-    printf("configureInputOutput called with tcp: %d, udp: %d, uds: %d, server: %d, client: %d, port: %d, hostname: %s, path: %s, change_in: %d, change_out: %d\n", tcp, udp, uds, server, client, port, hostname, path, change_in, change_out);
+    char *path = spec + 4;
+    size_t length = strlen(path);
+    size_t suffix = strlen(",direct");
+    bool direct = flag == 'o' && length > suffix && strcmp(path + length - suffix, ",direct") == 0;
+    if (direct)
+        path[length - suffix] = '\0';
 
-    if (hostname == NULL || (strcmp(hostname, "localhost") == 0))
+    int fd;
+    if (flag == 'i')
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    else
+    {
+        fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (direct ? O_DIRECT : 0), 0644);
+        if (fd == -1 && direct && errno == EINVAL)
+        {
+            LOG_INFO("%s does not support O_DIRECT, using buffered appends\n", path);
+            direct = false;
+            fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        }
+    }
+    if (fd == -1)
+    {
+        perror("error opening file");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    if (flag == 'o')
     {
-        char hostname[16]; // Make sure the size is sufficient to hold the string
-        strcpy(hostname, "127.0.0.1");
+        append_fd = fd;
+        append_direct = direct;
+    }
+    LOG_INFO("Opened file %s\n", path);
+    return fd;
+}
 
-        printf("Server address set to localhost as 127.0.0.1\n");
+/**
+ * open_fifo_endpoint: Opens a FIFO endpoint, creating the FIFO if it does not exist yet.
+ *                     Like accepting a connection, the open waits for the other end.
+ * @param spec: The endpoint argument, FIFO<path>.
+ * @param flag: 'i' to read the FIFO, 'o' to write it.
+ * @return The file descriptor.
+ */
+int open_fifo_endpoint(char *spec, char flag)
+{
+    char *path = spec + 4;
+    if (mkfifo(path, 0600) == -1 && errno != EEXIST)
+    {
+        perror("error creating FIFO");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    LOG_DEBUG("Waiting for the other end of FIFO %s\n", path);
+    int fd = open(path, (flag == 'i' ? O_RDONLY : O_WRONLY) | O_CLOEXEC);
+    if (fd == -1)
+    {
+        perror("error opening FIFO");
+        closeResourcesAndExit(EXIT_FAILURE);
     }
+    if (flag == 'i')
+        splice_fd = fd;
+    LOG_INFO("Opened FIFO %s\n", path);
+    return fd;
+}
+
+/**
+ * Update the input and output file descriptors
+ * For UDS endpoints tcp selects a stream socket, udp a datagram socket and seqpacket a
+ * SOCK_SEQPACKET socket (connection semantics with message boundaries).
+ * @param value the value to update the file descriptors
+ * @param input_need_change 1 if the input file descriptor needs to be changed, 0 otherwise
+ * @param output_need_change 1 if the output file descriptor needs to be changed, 0 otherwise
+ */
+void configureInputOutput(bool tcp, bool udp, bool uds, bool server, bool client, int port, char *hostname, char *path, int change_in, int change_out, bool seqpacket)
+{
+    LOG_DEBUG("configureInputOutput called with tcp: %d, udp: %d, uds: %d, server: %d, client: %d, port: %d, hostname: %s, path: %s, change_in: %d, change_out: %d, seqpacket: %d\n", tcp, udp, uds, server, client, port, hostname, path, change_in, change_out, seqpacket);
 
     int new_fd;
     if (!uds && tcp && server)
@@ -434,19 +958,27 @@ void configureInputOutput(bool tcp, bool udp, bool uds, bool server, bool client
     {
         new_fd = start_udp_client(hostname, port);
     }
-    else if (uds && tcp && server)
+    else if (uds && seqpacket && server)
+    {
+        new_fd = start_uds_server_seqpacket(path);
+    }
+    else if (uds && seqpacket && client)
+    {
+        new_fd = start_uds_client_seqpacket(path);
+    }
+    else if (uds && udp && server)
     {
         new_fd = start_uds_server_datagram(path);
     }
-    else if (uds && tcp && client)
+    else if (uds && udp && client)
     {
         new_fd = start_uds_client_datagram(path);
     }
-    else if (uds && udp && server)
+    else if (uds && tcp && server)
     {
         new_fd = start_uds_server_stream(path);
     }
-    else if (uds && udp && client)
+    else if (uds && tcp && client)
     {
         new_fd = start_uds_client_stream(path);
     }
@@ -458,20 +990,5396 @@ void configureInputOutput(bool tcp, bool udp, bool uds, bool server, bool client
 
     if (change_in)
     {
-        printf("Changing input_fd from %d to %d\n", input_fd, new_fd);
+        LOG_DEBUG("Changing input_fd from %d to %d\n", input_fd, new_fd);
         input_fd = new_fd;
     }
     if (change_out)
     {
-        printf("Changing output_fd from %d to %d\n", output_fd, new_fd);
+        LOG_DEBUG("Changing output_fd from %d to %d\n", output_fd, new_fd);
         output_fd = new_fd;
     }
 }
 
-char *extract_path(const char *arg)
+/**
+ * split_host_port: Splits a "host,port" or "port" endpoint argument in place.
+ * @param arg: The argument after the endpoint type, e.g. "myserver,1234" in TCPCmyserver,1234.
+ * @param hostname: Receives the host part, or NULL when only a port is given.
+ * @return The port number.
+ */
+int split_host_port(char *arg, char **hostname)
 {
-    // Find the "-i " option
-    const char *start = strstr(arg, "UDS");
+    char *port_str = strchr(arg, ',');
+    if (port_str == NULL)
+    {
+        // 1234
+        *hostname = NULL;
+        return atoi(arg);
+    }
+    // myserver,1234
+    *port_str = '\0'; // *hostname="myserver\0"
+    *hostname = arg;
+    return atoi(port_str + 1);
+}
+
+enum target_kind
+{
+    TARGET_TCP,
+    TARGET_UDP,
+    TARGET_UDS_STREAM,
+    TARGET_UDS_DATAGRAM,
+    TARGET_UDS_SEQPACKET
+};
+
+/**
+ * A client endpoint as written on the command line, e.g. TCPChost,port or UDSCS/path.
+ */
+struct client_target
+{
+    enum target_kind kind;
+    char *hostname;
+    int port;
+    char *path;
+};
+
+/**
+ * parse_client_target: Parses a client endpoint argument (TCPC, UDPC, UDSCS, UDSCD or UDSCP).
+ *                      The argument is split in place.
+ * @param arg: The endpoint argument.
+ * @param target: Receives the endpoint.
+ * @return 0 on success, -1 if the argument is not a client endpoint.
+ */
+int parse_client_target(char *arg, struct client_target *target)
+{
+    memset(target, 0, sizeof(*target));
+    if (strncmp(arg, "TCPC", 4) == 0 || strncmp(arg, "UDPC", 4) == 0)
+    {
+        target->kind = (arg[0] == 'T') ? TARGET_TCP : TARGET_UDP;
+        target->port = split_host_port(arg + 4, &target->hostname);
+        return 0;
+    }
+    if (strncmp(arg, "UDSC", 4) != 0 || strlen(arg) <= 5)
+    {
+        return -1;
+    }
+    target->path = arg + 5;
+    if (arg[4] == 'S')
+        target->kind = TARGET_UDS_STREAM;
+    else if (arg[4] == 'D')
+        target->kind = TARGET_UDS_DATAGRAM;
+    else if (arg[4] == 'P')
+        target->kind = TARGET_UDS_SEQPACKET;
+    else
+        return -1;
+    return 0;
+}
+
+/**
+ * open_client_target: Connects to a client endpoint with the matching start_* function.
+ * @return The connected socket file descriptor.
+ */
+int open_client_target(const struct client_target *target)
+{
+    switch (target->kind)
+    {
+    case TARGET_TCP:
+        return start_tcp_client(target->hostname, target->port);
+    case TARGET_UDP:
+        return start_udp_client(target->hostname, target->port);
+    case TARGET_UDS_STREAM:
+        return start_uds_client_stream(target->path);
+    case TARGET_UDS_DATAGRAM:
+        return start_uds_client_datagram(target->path);
+    case TARGET_UDS_SEQPACKET:
+        return start_uds_client_seqpacket(target->path);
+    }
+    return -1;
+}
+
+#define LATENCY_SUB_BUCKETS 32
+#define LATENCY_BUCKETS (60 * LATENCY_SUB_BUCKETS)
+
+/**
+ * A log-linear latency histogram: values below 32 ns have their own bucket, larger values
+ * share 32 buckets per power of two, so every bucket is within about 3% of its values.
+ */
+struct latency_histogram
+{
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+int latency_bucket(uint64_t value)
+{
+    if (value < LATENCY_SUB_BUCKETS)
+        return value;
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (value >> (exponent - 5)) & (LATENCY_SUB_BUCKETS - 1);
+    return (exponent - 4) * LATENCY_SUB_BUCKETS + sub;
+}
+
+uint64_t latency_bucket_value(int bucket)
+{
+    if (bucket < LATENCY_SUB_BUCKETS)
+        return bucket;
+    int exponent = bucket / LATENCY_SUB_BUCKETS + 4;
+    int sub = bucket % LATENCY_SUB_BUCKETS;
+    return (uint64_t)(LATENCY_SUB_BUCKETS + sub) << (exponent - 5);
+}
+
+void latency_record(struct latency_histogram *histogram, uint64_t value)
+{
+    histogram->counts[latency_bucket(value)]++;
+    histogram->total++;
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+void latency_merge(struct latency_histogram *histogram, const struct latency_histogram *other)
+{
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        histogram->counts[i] += other->counts[i];
+    histogram->total += other->total;
+    if (other->max > histogram->max)
+        histogram->max = other->max;
+}
+
+/**
+ * latency_percentile: Returns the value below which the given fraction of samples fall.
+ * @param fraction: The percentile as a fraction, e.g. 0.99.
+ */
+uint64_t latency_percentile(const struct latency_histogram *histogram, double fraction)
+{
+    uint64_t rank = (uint64_t)(fraction * histogram->total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if (seen >= rank)
+            return latency_bucket_value(i) < histogram->max ? latency_bucket_value(i) : histogram->max;
+    }
+    return histogram->max;
+}
+
+/**
+ * latency_print: Prints the count and the usual percentiles of a histogram in microseconds.
+ */
+void latency_print(FILE *stream, const char *label, const struct latency_histogram *histogram)
+{
+    if (histogram->total == 0)
+    {
+        fprintf(stream, "%s: no samples\n", label);
+        return;
+    }
+    fprintf(stream, "%s: %llu samples, p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+            label, (unsigned long long)histogram->total,
+            latency_percentile(histogram, 0.50) / 1000.0, latency_percentile(histogram, 0.90) / 1000.0,
+            latency_percentile(histogram, 0.99) / 1000.0, latency_percentile(histogram, 0.999) / 1000.0,
+            histogram->max / 1000.0);
+}
+
+#define RELAY_BUFFER_SIZE 65536
+#define CAPTURE_DEFAULT_MB 64
+#define RELAY_POOL_BUFFERS 8
+#define RELAY_MAX_IOV 64
+#define ZEROCOPY_DEFAULT_THRESHOLD 16384
+#define ZEROCOPY_MAX_INFLIGHT 256
+#define ADAPTOR_DATAGRAM_SIZE 1472
+#define UDP_HEADERS_SIZE 28
+#define UDP_MAX_PAYLOAD 65507
+#define FRAME_HEADER_SIZE 4
+#define FILE_CHUNK_SIZE (1 << 20)
+#define FILE_APPEND_SIZE (1 << 20)
+#define FILE_DIRECT_ALIGN 4096
+#define FILE_FLUSH_NS 100000000ull
+#define CAPTURE_MAGIC "MYNCCAP1"
+
+/**
+ * Header of a capture file, followed by the record area used as a ring.
+ * Records are valid in [tail, head) or, once the ring has wrapped, in [tail, wrap_end)
+ * followed by [0, head). Writers only touch the mapping, so the file stays readable
+ * after a crash.
+ */
+struct capture_header
+{
+    char magic[8];
+    uint64_t capacity;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t wrap_end;
+    uint64_t wrapped;
+    uint64_t records;
+    uint64_t dropped;
+};
+
+/**
+ * A captured chunk: the monotonic time it was relayed, its length and its direction
+ * ('I' for data read from input_fd, 'O' for data written by the command towards output_fd).
+ * The data follows the record, padded to 8 bytes.
+ */
+struct capture_record
+{
+    uint64_t timestamp_ns;
+    uint32_t length;
+    char direction;
+    char padding[3];
+};
+
+struct capture_header *capture = NULL;
+char *capture_data = NULL;
+
+uint64_t capture_record_size(uint32_t length)
+{
+    return (sizeof(struct capture_record) + length + 7) & ~(uint64_t)7;
+}
+
+/**
+ * capture_open: Creates a capture file of the given size and maps it.
+ *               An existing file is overwritten.
+ * @param path: The capture file path.
+ * @param megabytes: The size of the record area in megabytes.
+ */
+void capture_open(const char *path, unsigned int megabytes)
+{
+    uint64_t capacity = (uint64_t)megabytes * 1024 * 1024;
+    size_t size = sizeof(struct capture_header) + capacity;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || ftruncate(fd, size) == -1)
+    {
+        perror("Failed to create capture file");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("Failed to map capture file");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    capture = (struct capture_header *)map;
+    capture_data = (char *)map + sizeof(struct capture_header);
+    memcpy(capture->magic, CAPTURE_MAGIC, sizeof(capture->magic));
+    capture->capacity = capacity;
+    LOG_INFO("Capturing traffic to %s (%u MB)\n", path, megabytes);
+}
+
+/**
+ * capture_chunk: Appends a relayed chunk to the capture ring, evicting the oldest records
+ *                when there is no room. Does nothing when no capture is open.
+ * @param direction: 'I' for data from input_fd, 'O' for data towards output_fd.
+ * @param data: The chunk.
+ * @param length: The length of the chunk.
+ */
+void capture_chunk(char direction, const char *data, size_t length)
+{
+    if (capture == NULL)
+        return;
+
+    uint64_t size = capture_record_size(length);
+    if (size > capture->capacity)
+    {
+        capture->dropped++;
+        return;
+    }
+
+    while (true)
+    {
+        if (!capture->wrapped)
+        {
+            if (capture->head + size <= capture->capacity)
+                break;
+            // No room before the end: continue at the start of the area
+            capture->wrap_end = capture->head;
+            capture->head = 0;
+            capture->wrapped = 1;
+        }
+        if (capture->head + size <= capture->tail)
+            break;
+        if (capture->tail >= capture->wrap_end)
+        {
+            capture->tail = 0;
+            capture->wrapped = 0;
+            continue;
+        }
+        struct capture_record *oldest = (struct capture_record *)(capture_data + capture->tail);
+        capture->tail += capture_record_size(oldest->length);
+        capture->records--;
+    }
+
+    struct capture_record *record = (struct capture_record *)(capture_data + capture->head);
+    record->timestamp_ns = monotonic_ns();
+    record->length = length;
+    record->direction = direction;
+    memcpy(record + 1, data, length);
+    capture->head += size;
+    capture->records++;
+}
+
+#define SHM_RING_CAPACITY (1 << 20)
+#define SHM_RING_HEADER 256
+#define SHM_SPIN_MIN_NS 1000
+#define SHM_SPIN_MAX_NS 100000
+
+/**
+ * A single-producer single-consumer byte ring in shared memory. head and tail count the bytes
+ * written and read since the start, they sit on separate cache lines so the two sides do not
+ * bounce one line between them. A side that is about to sleep sets its waiting flag, the
+ * other side then signals the matching eventfd after it moved head or tail.
+ * The data follows the header at SHM_RING_HEADER.
+ */
+struct shm_ring
+{
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> consumer_waiting;
+    std::atomic<uint32_t> producer_waiting;
+    std::atomic<uint32_t> closed;
+    uint64_t capacity;
+};
+
+/**
+ * One direction of a shared-memory endpoint as seen by this process, with the eventfd the
+ * producer signals when data arrived and the one the consumer signals when space was freed.
+ * spin_ns is how long this side spins before it sleeps. It grows when spinning found work
+ * and shrinks when it did not.
+ */
+struct shm_channel
+{
+    struct shm_ring *ring;
+    char *data;
+    int data_fd;
+    int space_fd;
+    uint64_t spin_ns;
+};
+
+/**
+ * A shared-memory endpoint (SHMS/SHMC). sock is the UDS connection of the handshake, it stays
+ * open so that each side sees the other one exit. It also stands in for the endpoint in
+ * input_fd/output_fd, which makes the relay use the rings.
+ */
+struct shm_endpoint
+{
+    int sock;
+    struct shm_channel rx;
+    struct shm_channel tx;
+};
+
+struct shm_endpoint *shm = NULL;
+
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+void shm_signal(int fd)
+{
+    uint64_t one = 1;
+    ssize_t ignored = write(fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+void shm_drain(int fd)
+{
+    uint64_t count;
+    ssize_t ignored = read(fd, &count, sizeof(count));
+    (void)ignored;
+}
+
+bool shm_readable(const struct shm_channel *channel)
+{
+    const struct shm_ring *ring = channel->ring;
+    return ring->head.load(std::memory_order_acquire) != ring->tail.load(std::memory_order_relaxed) ||
+           ring->closed.load(std::memory_order_acquire);
+}
+
+/**
+ * shm_spin: Spins until ready() holds or the channel's spin time is over, and adapts it.
+ * @return true if ready() holds.
+ */
+template <typename Ready>
+bool shm_spin(struct shm_channel *channel, Ready ready)
+{
+    if (ready())
+        return true;
+    uint64_t start_ns = monotonic_ns();
+    for (unsigned int i = 1;; i++)
+    {
+        cpu_relax();
+        if (ready())
+        {
+            channel->spin_ns = channel->spin_ns * 2 < SHM_SPIN_MAX_NS ? channel->spin_ns * 2 : SHM_SPIN_MAX_NS;
+            return true;
+        }
+        if (i % 64 == 0 && monotonic_ns() - start_ns >= channel->spin_ns)
+            break;
+    }
+    channel->spin_ns = channel->spin_ns / 2 > SHM_SPIN_MIN_NS ? channel->spin_ns / 2 : SHM_SPIN_MIN_NS;
+    return false;
+}
+
+/**
+ * shm_prepare_wait: Spins for data, then announces that the consumer is going to sleep on
+ *                   data_fd. The check after the announcement catches data that arrived
+ *                   before the producer could see the flag.
+ * @return true if data (or the end of the stream) is there and there is no need to sleep.
+ */
+bool shm_prepare_wait(struct shm_channel *channel)
+{
+    if (shm_spin(channel, [channel] { return shm_readable(channel); }))
+        return true;
+    channel->ring->consumer_waiting.store(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!shm_readable(channel))
+        return false;
+    channel->ring->consumer_waiting.store(0, std::memory_order_relaxed);
+    return true;
+}
+
+void shm_finish_wait(struct shm_channel *channel)
+{
+    channel->ring->consumer_waiting.store(0, std::memory_order_relaxed);
+    shm_drain(channel->data_fd);
+}
+
+/**
+ * shm_read: Copies the available bytes out of a ring without blocking.
+ * @param peer_gone: true when the other side exited, an empty ring then ends the stream.
+ * @return The number of bytes read, 0 at the end of the stream, or -1 with errno EAGAIN.
+ */
+ssize_t shm_read(struct shm_channel *channel, char *buffer, size_t length, bool peer_gone)
+{
+    struct shm_ring *ring = channel->ring;
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint64_t available = ring->head.load(std::memory_order_acquire) - tail;
+    if (available == 0)
+    {
+        if (ring->closed.load(std::memory_order_acquire) || peer_gone)
+            return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t size = available < length ? available : length;
+    size_t offset = tail & (ring->capacity - 1);
+    size_t first = size < ring->capacity - offset ? size : ring->capacity - offset;
+    memcpy(buffer, channel->data + offset, first);
+    memcpy(buffer + first, channel->data, size - first);
+    ring->tail.store(tail + size, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring->producer_waiting.load(std::memory_order_relaxed))
+        shm_signal(channel->space_fd);
+    return size;
+}
+
+size_t shm_room(const struct shm_channel *channel)
+{
+    const struct shm_ring *ring = channel->ring;
+    return ring->capacity - (ring->head.load(std::memory_order_relaxed) - ring->tail.load(std::memory_order_acquire));
+}
+
+/**
+ * shm_prepare_space: Spins until a ring has room for a whole chunk, then announces that the
+ *                    producer is going to sleep on space_fd. Like shm_prepare_wait(), the
+ *                    check after the announcement catches space freed in the meantime.
+ * @return true if there is room and there is no need to sleep.
+ */
+bool shm_prepare_space(struct shm_channel *channel)
+{
+    if (shm_spin(channel, [channel] { return shm_room(channel) >= RELAY_BUFFER_SIZE; }))
+        return true;
+    channel->ring->producer_waiting.store(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (shm_room(channel) < RELAY_BUFFER_SIZE)
+        return false;
+    channel->ring->producer_waiting.store(0, std::memory_order_relaxed);
+    return true;
+}
+
+void shm_finish_space(struct shm_channel *channel)
+{
+    channel->ring->producer_waiting.store(0, std::memory_order_relaxed);
+    shm_drain(channel->space_fd);
+}
+
+/**
+ * shm_write: Copies as much of the data into a ring as it has room for, without blocking.
+ *            The relay waits for room in its poll loop (shm_prepare_space()), so that a
+ *            process with both directions keeps draining its inbound ring meanwhile.
+ * @return The number of bytes written, or -1 with errno EAGAIN if the ring is full.
+ */
+ssize_t shm_write(struct shm_channel *channel, const char *data, size_t length)
+{
+    struct shm_ring *ring = channel->ring;
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    size_t room = shm_room(channel);
+    if (room == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t size = room < length ? room : length;
+    size_t offset = head & (ring->capacity - 1);
+    size_t first = size < ring->capacity - offset ? size : ring->capacity - offset;
+    memcpy(channel->data + offset, data, first);
+    memcpy(channel->data, data + first, size - first);
+    ring->head.store(head + size, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring->consumer_waiting.load(std::memory_order_relaxed))
+        shm_signal(channel->data_fd);
+    return size;
+}
+
+void shm_close(struct shm_channel *channel)
+{
+    channel->ring->closed.store(1, std::memory_order_seq_cst);
+    shm_signal(channel->data_fd);
+}
+
+#define TRACE_PENDING 64
+#define TRACE_DRAIN_NS 200000000ull
+
+/**
+ * A sampled chunk on its way through the relay. The times are CLOCK_REALTIME in ns, the clock of
+ * the kernel timestamps. A kernel time is 0 when the fd has no timestamps (pipes, UDS).
+ */
+struct trace_record
+{
+    char direction;
+    uint32_t length;
+    uint64_t rx_kernel_ns;
+    uint64_t rx_user_ns;
+    uint64_t tx_user_ns;
+    uint64_t tx_kernel_ns;
+};
+
+/**
+ * Tracing state (-T rate[,file]). rate is the fraction of chunks that are traced, credit
+ * accumulates it so that the samples are evenly spaced. The histograms split the time of a chunk
+ * into its wait in the receive queue, mync's relay loop and the send path down to the device.
+ * command is the time from a chunk written to the -e command to the command's next output.
+ */
+struct trace_state
+{
+    double rate;
+    double credit;
+    FILE *file;
+    struct latency_histogram receive;
+    struct latency_histogram relay;
+    struct latency_histogram send;
+    struct latency_histogram total;
+    struct latency_histogram command;
+    uint64_t command_sent_ns;
+};
+
+struct trace_state *trace = NULL;
+
+uint64_t realtime_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+int socket_option(int fd, int option)
+{
+    int value = -1;
+    socklen_t length = sizeof(value);
+    if (getsockopt(fd, SOL_SOCKET, option, &value, &length) == -1)
+        return -1;
+    return value;
+}
+
+/**
+ * trace_open: Starts tracing the relay.
+ * @param rate: The fraction of chunks to trace, 1 traces every chunk.
+ * @param path: The file that gets a line per traced chunk and the report, or NULL for a
+ *              report on stderr only.
+ */
+void trace_open(double rate, const char *path)
+{
+    trace = (struct trace_state *)calloc(1, sizeof(*trace));
+    if (trace == NULL)
+    {
+        perror("calloc");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    trace->rate = rate;
+    if (path != NULL)
+    {
+        trace->file = fopen(path, "w");
+        if (trace->file == NULL)
+        {
+            perror("Failed to open trace file");
+            closeResourcesAndExit(EXIT_FAILURE);
+        }
+        fprintf(trace->file, "# direction bytes rx_kernel_ns rx_user_ns tx_user_ns tx_kernel_ns\n");
+    }
+}
+
+bool trace_sample()
+{
+    if (trace == NULL)
+        return false;
+    trace->credit += trace->rate;
+    if (trace->credit < 1)
+        return false;
+    trace->credit -= 1;
+    return true;
+}
+
+/**
+ * trace_enable: Turns on software timestamping of a TCP or UDP socket, keeping the flags set
+ *               for the other direction when the socket is both a source and a destination.
+ * @param flags: SOF_TIMESTAMPING_RX_SOFTWARE for a source. For a destination, TX timestamps are
+ *               requested by the sampled sends themselves.
+ * @return true if the socket reports timestamps.
+ */
+bool trace_enable(int fd, int flags)
+{
+    int domain = socket_option(fd, SO_DOMAIN);
+    if (domain != AF_INET && domain != AF_INET6)
+        return false;
+    int current = socket_option(fd, SO_TIMESTAMPING);
+    if (current != -1)
+        flags |= current;
+    flags |= SOF_TIMESTAMPING_SOFTWARE;
+    return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0;
+}
+
+/**
+ * trace_finish: Adds a traced chunk to the histograms and to the trace file.
+ */
+void trace_finish(const struct trace_record *record)
+{
+    if (record->rx_kernel_ns != 0 && record->rx_user_ns > record->rx_kernel_ns)
+        latency_record(&trace->receive, record->rx_user_ns - record->rx_kernel_ns);
+    latency_record(&trace->relay, record->tx_user_ns - record->rx_user_ns);
+    if (record->tx_kernel_ns != 0 && record->tx_kernel_ns > record->tx_user_ns)
+        latency_record(&trace->send, record->tx_kernel_ns - record->tx_user_ns);
+    uint64_t start_ns = record->rx_kernel_ns ? record->rx_kernel_ns : record->rx_user_ns;
+    uint64_t end_ns = record->tx_kernel_ns ? record->tx_kernel_ns : record->tx_user_ns;
+    if (end_ns > start_ns)
+        latency_record(&trace->total, end_ns - start_ns);
+    if (trace->file != NULL)
+        fprintf(trace->file, "%c %u %llu %llu %llu %llu\n", record->direction, record->length,
+                (unsigned long long)record->rx_kernel_ns, (unsigned long long)record->rx_user_ns,
+                (unsigned long long)record->tx_user_ns, (unsigned long long)record->tx_kernel_ns);
+}
+
+void trace_report()
+{
+    FILE *stream = trace->file != NULL ? trace->file : stderr;
+    fprintf(stream, "# Latency breakdown of the traced chunks\n");
+    latency_print(stream, "# kernel receive queue", &trace->receive);
+    latency_print(stream, "# mync relay", &trace->relay);
+    latency_print(stream, "# kernel send", &trace->send);
+    latency_print(stream, "# command", &trace->command);
+    latency_print(stream, "# ingress to egress", &trace->total);
+    fflush(stream);
+}
+
+/**
+ * One direction of the relay, from a readable fd to a writable fd.
+ * When the destination is a TCP socket, chunks of at least zerocopy_threshold bytes are
+ * sent with MSG_ZEROCOPY. The kernel then reads them from our buffer after sendmsg()
+ * returned, so the path cycles through a pool of buffers and a buffer is only reused once
+ * the error queue reported all its sends complete.
+ * With tracing, sampled chunks keep a trace record. A chunk sent to a TCP or UDP socket waits
+ * in pending until its TX timestamp arrives on the same error queue.
+ * The adaptor (-F) converts between streams and datagrams, see relay_path_init().
+ * A regular file source is mapped and sent from the mapping, or handed to the kernel with
+ * sendfile() when nothing in mync needs to see the data. Writes to the FILE output endpoint
+ * are gathered in staging and appended in large writes.
+ */
+struct relay_buffer
+{
+    char *data;
+    unsigned int inflight;
+    uint32_t headers[RELAY_MAX_IOV];
+};
+
+enum relay_adaptor
+{
+    ADAPTOR_NONE,
+    ADAPTOR_DATAGRAMS,
+    ADAPTOR_FRAME,
+    ADAPTOR_DEFRAME
+};
+
+enum relay_transfer
+{
+    TRANSFER_COPY,
+    TRANSFER_SENDFILE,
+    TRANSFER_SPLICE
+};
+
+struct relay_path
+{
+    int from;
+    int to;
+    char direction;
+    bool open;
+    bool coalesce;
+    bool from_datagrams;
+    bool zerocopy;
+    int nbuffers;
+    int current;
+    struct relay_buffer buffers[RELAY_POOL_BUFFERS];
+    uint32_t next_sequence;
+    uint32_t inflight;
+    int sequence_owner[ZEROCOPY_MAX_INFLIGHT];
+    bool rx_timestamps;
+    bool tx_timestamps;
+    bool sampled;
+    struct trace_record sample;
+    struct trace_record pending[TRACE_PENDING];
+    int pending_first;
+    int npending;
+    struct shm_channel *from_channel;
+    struct shm_channel *to_channel;
+    bool peer_gone;
+    bool from_reliable;
+    bool to_reliable;
+    size_t delivery_size;
+    enum relay_adaptor adaptor;
+    size_t datagram_size;
+    char *staging;
+    size_t staged;
+    size_t skip;
+    uint64_t flush_ns;
+    enum relay_transfer transfer;
+    char *mapped;
+    size_t mapped_size;
+    size_t mapped_offset;
+    bool append;
+    bool direct;
+    off_t file_end;
+};
+
+size_t zerocopy_threshold = ZEROCOPY_DEFAULT_THRESHOLD;
+// The adaptor's flush deadline in microseconds (-F), -1 without the adaptor
+long flush_deadline_us = -1;
+// Stream sockets carry length-prefixed frames (-F usec,frame)
+bool adaptor_framing = false;
+
+/**
+ * datagram_payload: The largest datagram that the destination carries without fragmenting,
+ *                   from the path MTU of a connected UDP socket.
+ */
+size_t datagram_payload(int fd)
+{
+    int mtu = 0;
+    socklen_t length = sizeof(mtu);
+    if (socket_option(fd, SO_DOMAIN) != AF_INET || getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &length) == -1 ||
+        mtu <= UDP_HEADERS_SIZE)
+        return ADAPTOR_DATAGRAM_SIZE;
+    size_t payload = mtu - UDP_HEADERS_SIZE;
+    return payload < UDP_MAX_PAYLOAD ? payload : UDP_MAX_PAYLOAD;
+}
+
+#define REL_HEADER_SIZE 20
+#define REL_MAX_PAYLOAD 8192
+#define REL_WINDOW 64
+#define REL_SACK_BITS 64
+#define REL_DUP_THRESHOLD 3
+#define REL_MAX_RETRIES 10
+#define REL_INITIAL_RTO_NS 200000000ull
+#define REL_MIN_RTO_NS 10000000ull
+#define REL_MAX_RTO_NS 2000000000ull
+#define REL_LINGER_NS 3000000000ull
+#define REL_QUIET_RTOS 4
+
+/**
+ * Flags of a reliable datagram (-R). DATA packets take a sequence number and are delivered in
+ * order, SYN opens the session from the client so the server learns its address, FIN ends the
+ * stream. A packet without DATA only acknowledges.
+ */
+enum rel_flags
+{
+    REL_DATA = 1,
+    REL_SYN = 2,
+    REL_FIN = 4,
+    REL_PROBE = 8
+};
+
+/**
+ * A packet that was sent and is not acknowledged yet. reordered counts the acknowledgements
+ * that covered later packets but not this one, REL_DUP_THRESHOLD of them retransmit it early.
+ */
+struct rel_packet
+{
+    char *data;
+    size_t length;
+    uint64_t sent_ns;
+    unsigned int retries;
+    unsigned int reordered;
+    bool acked;
+};
+
+struct rel_slot
+{
+    char *data;
+    size_t length;
+    size_t offset;
+    uint8_t flags;
+    bool present;
+};
+
+/**
+ * The reliability layer of a connected UDP socket. Every packet starts with a 20 byte header:
+ * flags, a reserved byte, the receive window, then seq, ack (the first sequence number not
+ * received yet) and a selective ack bitmap of the REL_SACK_BITS packets after ack, all in
+ * network order. The bitmap covers the whole window, so no packet that arrived is sent again
+ * on a timeout. Every packet carries the current acknowledgement, so data going back
+ * acknowledges for free. Received packets wait in received until they are read, the window
+ * tells the sender how many more fit. A closed window is probed in case the update that opened
+ * it was lost, first after a timeout and then backing off like a retransmission.
+ * The retransmission timeout follows RFC 6298 from the round trips of packets that were
+ * sent once, and doubles on every timeout.
+ */
+struct reliable
+{
+    int fd;
+    size_t payload;
+    uint32_t snd_una;
+    uint32_t snd_nxt;
+    struct rel_packet sent[REL_WINDOW];
+    uint32_t peer_window;
+    uint32_t rcv_nxt;
+    struct rel_slot received[REL_WINDOW];
+    uint32_t advertised;
+    bool ack_pending;
+    bool fin_pending;
+    uint64_t probe_ns;
+    uint64_t probe_interval_ns;
+    bool have_rtt;
+    uint64_t srtt_ns;
+    uint64_t rttvar_ns;
+    uint64_t rto_ns;
+    uint64_t retransmits;
+    uint64_t fast_retransmits;
+};
+
+struct reliable *reliable = NULL;
+
+/**
+ * rel_transmit: Sends a packet with the current acknowledgement in its header.
+ */
+void rel_transmit(struct reliable *rel, char *packet, size_t length)
+{
+    uint32_t ack = rel->rcv_nxt;
+    while (ack - rel->rcv_nxt < REL_WINDOW && rel->received[ack % REL_WINDOW].present)
+        ack++;
+    uint64_t sack = 0;
+    for (uint32_t i = 0; i < REL_SACK_BITS && ack + 1 + i - rel->rcv_nxt < REL_WINDOW; i++)
+    {
+        if (rel->received[(ack + 1 + i) % REL_WINDOW].present)
+            sack |= 1ull << i;
+    }
+    rel->advertised = REL_WINDOW - (ack - rel->rcv_nxt);
+    uint16_t window = htons(rel->advertised);
+    memcpy(packet + 2, &window, sizeof(window));
+    ack = htonl(ack);
+    sack = htobe64(sack);
+    memcpy(packet + 8, &ack, sizeof(ack));
+    memcpy(packet + 12, &sack, sizeof(sack));
+    // A lost send is recovered like a lost packet
+    if (send(rel->fd, packet, length, MSG_NOSIGNAL) == -1 && errno != ECONNREFUSED && errno != EAGAIN)
+        LOG_DEBUG("Reliable send failed: %s\n", strerror(errno));
+    rel->ack_pending = false;
+}
+
+void rel_send_ack(struct reliable *rel, uint8_t flags)
+{
+    char packet[REL_HEADER_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = flags;
+    uint32_t seq = htonl(rel->snd_nxt);
+    memcpy(packet + 4, &seq, sizeof(seq));
+    rel_transmit(rel, packet, sizeof(packet));
+}
+
+/**
+ * rel_queue: Sends a packet that takes the next sequence number. The caller made sure there
+ *            is room in the window.
+ */
+void rel_queue(struct reliable *rel, uint8_t flags, const char *data, size_t length)
+{
+    struct rel_packet *packet = &rel->sent[rel->snd_nxt % REL_WINDOW];
+    if (packet->data == NULL)
+    {
+        packet->data = (char *)malloc(REL_HEADER_SIZE + rel->payload);
+        if (packet->data == NULL)
+        {
+            perror("malloc");
+            closeResourcesAndExit(EXIT_FAILURE);
+        }
+    }
+    memset(packet->data, 0, REL_HEADER_SIZE);
+    packet->data[0] = REL_DATA | flags;
+    uint32_t seq = htonl(rel->snd_nxt);
+    memcpy(packet->data + 4, &seq, sizeof(seq));
+    memcpy(packet->data + REL_HEADER_SIZE, data, length);
+    packet->length = REL_HEADER_SIZE + length;
+    packet->sent_ns = monotonic_ns();
+    packet->retries = 0;
+    packet->reordered = 0;
+    packet->acked = false;
+    rel->snd_nxt++;
+    rel_transmit(rel, packet->data, packet->length);
+}
+
+void rel_rtt_sample(struct reliable *rel, uint64_t rtt_ns)
+{
+    if (!rel->have_rtt)
+    {
+        rel->srtt_ns = rtt_ns;
+        rel->rttvar_ns = rtt_ns / 2;
+        rel->have_rtt = true;
+    }
+    else
+    {
+        uint64_t delta = rel->srtt_ns > rtt_ns ? rel->srtt_ns - rtt_ns : rtt_ns - rel->srtt_ns;
+        rel->rttvar_ns = (3 * rel->rttvar_ns + delta) / 4;
+        rel->srtt_ns = (7 * rel->srtt_ns + rtt_ns) / 8;
+    }
+    uint64_t rto = rel->srtt_ns + 4 * rel->rttvar_ns;
+    rel->rto_ns = rto < REL_MIN_RTO_NS ? REL_MIN_RTO_NS : rto > REL_MAX_RTO_NS ? REL_MAX_RTO_NS : rto;
+}
+
+void rel_mark_acked(struct reliable *rel, uint32_t seq, uint64_t now)
+{
+    struct rel_packet *packet = &rel->sent[seq % REL_WINDOW];
+    if (packet->acked)
+        return;
+    packet->acked = true;
+    // Karn: the round trip of a retransmitted packet is ambiguous
+    if (packet->retries == 0)
+        rel_rtt_sample(rel, now - packet->sent_ns);
+}
+
+/**
+ * rel_process_ack: Applies the acknowledgement of a received packet. Packets below ack and
+ *                  the ones in the bitmap are done, a packet that later packets overtook
+ *                  REL_DUP_THRESHOLD times is retransmitted without waiting for the timeout.
+ */
+void rel_process_ack(struct reliable *rel, uint32_t ack, uint64_t sack)
+{
+    uint64_t now = monotonic_ns();
+    if (ack - rel->snd_una > rel->snd_nxt - rel->snd_una)
+        return;
+    for (uint32_t seq = rel->snd_una; seq != ack; seq++)
+        rel_mark_acked(rel, seq, now);
+    uint32_t highest = ack;
+    for (uint32_t i = 0; i < REL_SACK_BITS; i++)
+    {
+        uint32_t seq = ack + 1 + i;
+        if ((sack & (1ull << i)) && seq - rel->snd_una < rel->snd_nxt - rel->snd_una)
+        {
+            rel_mark_acked(rel, seq, now);
+            highest = seq;
+        }
+    }
+    while (rel->snd_una != rel->snd_nxt && rel->sent[rel->snd_una % REL_WINDOW].acked)
+        rel->snd_una++;
+
+    for (uint32_t seq = rel->snd_una; seq - rel->snd_una < highest - rel->snd_una && highest - rel->snd_una <= REL_WINDOW; seq++)
+    {
+        struct rel_packet *packet = &rel->sent[seq % REL_WINDOW];
+        if (!packet->acked && ++packet->reordered == REL_DUP_THRESHOLD)
+        {
+            packet->retries++;
+            packet->sent_ns = now;
+            rel->fast_retransmits++;
+            rel_transmit(rel, packet->data, packet->length);
+        }
+    }
+}
+
+/**
+ * rel_skip_control: Passes over delivered SYN packets, which carry no data.
+ */
+void rel_skip_control(struct reliable *rel)
+{
+    struct rel_slot *slot = &rel->received[rel->rcv_nxt % REL_WINDOW];
+    while (slot->present && (slot->flags & REL_SYN) && slot->length == 0)
+    {
+        slot->present = false;
+        rel->rcv_nxt++;
+        slot = &rel->received[rel->rcv_nxt % REL_WINDOW];
+    }
+}
+
+/**
+ * rel_input: Reads the packets waiting on the socket, applies their acknowledgements and
+ *            keeps their data until it can be delivered in order.
+ */
+void rel_input(struct reliable *rel)
+{
+    static char buffer[REL_HEADER_SIZE + REL_MAX_PAYLOAD];
+    while (true)
+    {
+        ssize_t size = recv(rel->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (size == -1 && (errno == EINTR || errno == ECONNREFUSED))
+            continue;
+        if (size == -1)
+            return;
+        if (size < REL_HEADER_SIZE)
+            continue;
+        uint16_t window;
+        uint32_t seq, ack;
+        uint64_t sack;
+        memcpy(&window, buffer + 2, sizeof(window));
+        memcpy(&seq, buffer + 4, sizeof(seq));
+        memcpy(&ack, buffer + 8, sizeof(ack));
+        memcpy(&sack, buffer + 12, sizeof(sack));
+        seq = ntohl(seq);
+        rel->peer_window = ntohs(window);
+        rel_process_ack(rel, ntohl(ack), be64toh(sack));
+        if (buffer[0] & REL_PROBE)
+            rel->ack_pending = true;
+        if (!(buffer[0] & REL_DATA))
+            continue;
+
+        // Duplicates and packets beyond the window are acknowledged again but not kept
+        rel->ack_pending = true;
+        struct rel_slot *slot = &rel->received[seq % REL_WINDOW];
+        if (seq - rel->rcv_nxt >= REL_WINDOW || slot->present)
+            continue;
+        size_t length = size - REL_HEADER_SIZE;
+        if (slot->data == NULL)
+        {
+            slot->data = (char *)malloc(REL_MAX_PAYLOAD);
+            if (slot->data == NULL)
+            {
+                perror("malloc");
+                closeResourcesAndExit(EXIT_FAILURE);
+            }
+        }
+        memcpy(slot->data, buffer + REL_HEADER_SIZE, length);
+        slot->length = length;
+        slot->offset = 0;
+        slot->flags = buffer[0];
+        slot->present = true;
+        rel_skip_control(rel);
+    }
+}
+
+bool rel_readable(const struct reliable *rel)
+{
+    return rel->received[rel->rcv_nxt % REL_WINDOW].present;
+}
+
+/**
+ * rel_read: Delivers the next data in order.
+ * @return The number of bytes, 0 at the end of the stream, or -1 with errno EAGAIN.
+ */
+ssize_t rel_read(struct reliable *rel, char *buffer, size_t length)
+{
+    struct rel_slot *slot = &rel->received[rel->rcv_nxt % REL_WINDOW];
+    if (!slot->present)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (slot->flags & REL_FIN)
+        return 0;
+    size_t size = slot->length - slot->offset < length ? slot->length - slot->offset : length;
+    memcpy(buffer, slot->data + slot->offset, size);
+    slot->offset += size;
+    if (slot->offset == slot->length)
+    {
+        slot->present = false;
+        rel->rcv_nxt++;
+        rel_skip_control(rel);
+        // The sender may be waiting for the window to open
+        if (rel->advertised < REL_WINDOW / 4)
+            rel->ack_pending = true;
+    }
+    return size;
+}
+
+/**
+ * rel_room: The bytes that can be sent without waiting for the peer.
+ */
+size_t rel_room(const struct reliable *rel)
+{
+    uint32_t window = rel->peer_window < REL_WINDOW ? rel->peer_window : REL_WINDOW;
+    uint32_t inflight = rel->snd_nxt - rel->snd_una;
+    return inflight < window ? (window - inflight) * rel->payload : 0;
+}
+
+/**
+ * rel_deadline: The time the oldest unacknowledged packet times out, or the next window probe
+ *               is due, 0 if there is nothing to wait for.
+ */
+uint64_t rel_deadline(const struct reliable *rel)
+{
+    uint64_t deadline = rel->probe_ns;
+    for (uint32_t seq = rel->snd_una; seq != rel->snd_nxt; seq++)
+    {
+        const struct rel_packet *packet = &rel->sent[seq % REL_WINDOW];
+        if (!packet->acked && (deadline == 0 || packet->sent_ns + rel->rto_ns < deadline))
+            deadline = packet->sent_ns + rel->rto_ns;
+    }
+    return deadline;
+}
+
+/**
+ * rel_tick: Retransmits the packets whose timeout expired and backs the timeout off, and
+ *           probes a window that is closed with nothing in flight.
+ * @return 0, or -1 once a packet was retransmitted REL_MAX_RETRIES times.
+ */
+int rel_tick(struct reliable *rel)
+{
+    uint64_t now = monotonic_ns();
+    if (rel->fin_pending && rel_room(rel) > 0)
+    {
+        rel->fin_pending = false;
+        rel_queue(rel, REL_FIN, NULL, 0);
+    }
+    if (rel->snd_una != rel->snd_nxt || rel->peer_window > 0)
+        rel->probe_ns = 0;
+    else if (rel->probe_ns == 0)
+    {
+        rel->probe_interval_ns = rel->rto_ns;
+        rel->probe_ns = now + rel->probe_interval_ns;
+    }
+    else if (rel->probe_ns <= now)
+    {
+        rel_send_ack(rel, REL_PROBE);
+        if (rel->probe_interval_ns * 2 < REL_MAX_RTO_NS)
+            rel->probe_interval_ns *= 2;
+        rel->probe_ns = now + rel->probe_interval_ns;
+    }
+
+    bool expired = false;
+    for (uint32_t seq = rel->snd_una; seq != rel->snd_nxt; seq++)
+    {
+        struct rel_packet *packet = &rel->sent[seq % REL_WINDOW];
+        if (packet->acked || packet->sent_ns + rel->rto_ns > now)
+            continue;
+        if (packet->retries == REL_MAX_RETRIES)
+        {
+            fprintf(stderr, "Reliable datagrams: the peer stopped answering\n");
+            return -1;
+        }
+        packet->retries++;
+        packet->sent_ns = now;
+        rel->retransmits++;
+        rel_transmit(rel, packet->data, packet->length);
+        expired = true;
+    }
+    if (expired)
+        rel->rto_ns = rel->rto_ns * 2 < REL_MAX_RTO_NS ? rel->rto_ns * 2 : REL_MAX_RTO_NS;
+    return 0;
+}
+
+/**
+ * rel_wait: Waits for acknowledgements until the window has room for one more packet, or
+ *           until everything was acknowledged when drain is set.
+ * @param limit_ns: Give up at this time, 0 to wait as long as the peer answers.
+ * @return 0 on success, -1 if the peer stopped answering.
+ */
+int rel_wait(struct reliable *rel, bool drain, uint64_t limit_ns)
+{
+    uint32_t window = rel->peer_window < REL_WINDOW ? rel->peer_window : REL_WINDOW;
+    while (drain ? rel->snd_una != rel->snd_nxt || rel->fin_pending : rel->snd_nxt - rel->snd_una >= window)
+    {
+        if (rel_tick(rel) == -1)
+            return -1;
+        uint64_t now = monotonic_ns();
+        if (limit_ns != 0 && now >= limit_ns)
+            return -1;
+        uint64_t deadline = rel_deadline(rel);
+        if (limit_ns != 0 && (deadline == 0 || deadline > limit_ns))
+            deadline = limit_ns;
+        struct pollfd pfd;
+        pfd.fd = rel->fd;
+        pfd.events = POLLIN;
+        int timeout_ms = deadline == 0 ? -1 : deadline > now ? (int)((deadline - now + 999999) / 1000000) : 0;
+        if (poll(&pfd, 1, timeout_ms) == -1 && errno != EINTR)
+            return -1;
+        rel_input(rel);
+        if (rel->ack_pending)
+            rel_send_ack(rel, 0);
+        window = rel->peer_window < REL_WINDOW ? rel->peer_window : REL_WINDOW;
+    }
+    return 0;
+}
+
+/**
+ * rel_write: Sends data as packets of up to the path's payload, waiting for room in the window.
+ * @return 0 on success, -1 if the peer stopped answering.
+ */
+int rel_write(struct reliable *rel, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        if (rel_wait(rel, false, 0) == -1)
+            return -1;
+        size_t size = length < rel->payload ? length : rel->payload;
+        rel_queue(rel, 0, data, size);
+        data += size;
+        length -= size;
+    }
+    return 0;
+}
+
+/**
+ * rel_close: Ends the stream with a FIN, which is delivered after all the data. It goes out
+ *            from rel_tick() once the window has room, the relay does not wait for it.
+ */
+void rel_close(struct reliable *rel)
+{
+    rel->fin_pending = true;
+    rel_tick(rel);
+}
+
+/**
+ * rel_quiesce: Keeps acknowledging after the session until the peer was quiet for
+ *              REL_QUIET_RTOS timeouts, in case the last acknowledgement was lost.
+ */
+void rel_quiesce(struct reliable *rel)
+{
+    struct pollfd pfd;
+    pfd.fd = rel->fd;
+    pfd.events = POLLIN;
+    int timeout_ms = (int)((REL_QUIET_RTOS * rel->rto_ns + 999999) / 1000000);
+    while (poll(&pfd, 1, timeout_ms) > 0)
+    {
+        rel_input(rel);
+        if (rel->ack_pending)
+            rel_send_ack(rel, 0);
+    }
+}
+
+/**
+ * rel_start: Sets up the reliability layer on a UDP socket. A server socket waits for the first
+ *            packet and connects to its sender, a client socket opens the session with a SYN.
+ */
+void rel_start(int fd)
+{
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    bool client = getpeername(fd, (struct sockaddr *)&peer, &peer_len) == 0;
+    if (!client)
+    {
+        char byte;
+        peer_len = sizeof(peer);
+        LOG_INFO("Waiting for the reliable session's client\n");
+        if (recvfrom(fd, &byte, sizeof(byte), MSG_PEEK, (struct sockaddr *)&peer, &peer_len) == -1 ||
+            connect(fd, (struct sockaddr *)&peer, peer_len) == -1)
+        {
+            perror("error connecting to the client");
+            closeResourcesAndExit(EXIT_FAILURE);
+        }
+    }
+
+    reliable = (struct reliable *)calloc(1, sizeof(struct reliable));
+    if (reliable == NULL)
+    {
+        perror("calloc");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    reliable->fd = fd;
+    size_t payload = datagram_payload(fd) - REL_HEADER_SIZE;
+    reliable->payload = payload < REL_MAX_PAYLOAD ? payload : REL_MAX_PAYLOAD;
+    reliable->rto_ns = REL_INITIAL_RTO_NS;
+    reliable->peer_window = REL_WINDOW;
+    reliable->advertised = REL_WINDOW;
+    if (client)
+        rel_queue(reliable, REL_SYN, NULL, 0);
+    LOG_INFO("Reliable datagrams of up to %zu bytes\n", reliable->payload);
+}
+
+/**
+ * relay_path_init: Sets up a relay path and picks its send strategy from the fd types.
+ *                  Messages read from a datagram or seqpacket socket are coalesced into one
+ *                  vectored send when the destination is a TCP stream, and a TCP destination
+ *                  gets SO_ZEROCOPY unless the threshold is 0.
+ *                  With the adaptor, a stream sent to a datagram or seqpacket socket is packed
+ *                  into datagrams of up to the MTU, which wait for more data until the flush
+ *                  deadline. With framing, each message sent to a stream socket gets a 4 byte
+ *                  length prefix, and the frames read from a stream socket become datagrams
+ *                  again. Commands and stdio always get the bare data.
+ */
+void relay_path_init(struct relay_path *path, int from, int to, char direction)
+{
+    memset(path, 0, sizeof(*path));
+    path->from = from;
+    path->to = to;
+    path->direction = direction;
+    path->open = true;
+
+    // The handshake socket of a shared-memory endpoint stands for its rings
+    if (shm != NULL && from == shm->sock)
+        path->from_channel = &shm->rx;
+    if (shm != NULL && to == shm->sock)
+        path->to_channel = &shm->tx;
+    // So does the socket under the reliable datagrams, which carry a byte stream
+    path->from_reliable = reliable != NULL && from == reliable->fd;
+    path->to_reliable = reliable != NULL && to == reliable->fd;
+    bool from_opaque = path->from_channel != NULL || path->from_reliable;
+    bool to_opaque = path->to_channel != NULL || path->to_reliable;
+    // Received data goes out in writes that a writable pipe or socket takes without blocking
+    struct stat to_stat;
+    path->delivery_size = fstat(to, &to_stat) == 0 && S_ISREG(to_stat.st_mode) ? RELAY_BUFFER_SIZE : PIPE_BUF;
+
+    bool to_tcp = !to_opaque && socket_option(to, SO_PROTOCOL) == IPPROTO_TCP;
+    int from_type = from_opaque ? -1 : socket_option(from, SO_TYPE);
+    int to_type = to_opaque ? -1 : socket_option(to, SO_TYPE);
+    bool from_messages = from_type == SOCK_DGRAM || from_type == SOCK_SEQPACKET;
+    bool to_messages = to_type == SOCK_DGRAM || to_type == SOCK_SEQPACKET;
+    path->coalesce = to_tcp && from_messages;
+
+    if (flush_deadline_us >= 0 && !from_messages && to_messages)
+        path->adaptor = (adaptor_framing && from_type == SOCK_STREAM) ? ADAPTOR_DEFRAME : ADAPTOR_DATAGRAMS;
+    else if (flush_deadline_us >= 0 && adaptor_framing && from_messages && to_type == SOCK_STREAM)
+        path->adaptor = ADAPTOR_FRAME;
+    if (path->adaptor == ADAPTOR_DATAGRAMS || path->adaptor == ADAPTOR_DEFRAME)
+    {
+        path->datagram_size = datagram_payload(to);
+        // A frame must fit a datagram of a UDP destination, other sockets carry any frame that fits the staging
+        if (path->adaptor == ADAPTOR_DEFRAME && socket_option(to, SO_DOMAIN) != AF_INET)
+            path->datagram_size = RELAY_BUFFER_SIZE;
+        path->staging = (char *)malloc(RELAY_BUFFER_SIZE + FRAME_HEADER_SIZE);
+        if (path->staging == NULL)
+        {
+            perror("malloc");
+            closeResourcesAndExit(EXIT_FAILURE);
+        }
+    }
+    path->from_datagrams = from_type == SOCK_DGRAM;
+
+    int one = 1;
+    path->zerocopy = to_tcp && zerocopy_threshold > 0 &&
+                     setsockopt(to, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    path->nbuffers = path->zerocopy ? RELAY_POOL_BUFFERS : 1;
+    for (int i = 0; i < path->nbuffers; i++)
+    {
+        path->buffers[i].data = (char *)malloc(RELAY_BUFFER_SIZE);
+        if (path->buffers[i].data == NULL)
+        {
+            perror("malloc");
+            closeResourcesAndExit(EXIT_FAILURE);
+        }
+    }
+    if (trace != NULL && !from_opaque && !to_opaque)
+    {
+        path->rx_timestamps = trace_enable(from, SOF_TIMESTAMPING_RX_SOFTWARE);
+        path->tx_timestamps = trace_enable(to, SOF_TIMESTAMPING_OPT_TSONLY);
+    }
+
+    // Files and FIFOs: the kernel moves the data itself when mync does not need to see it
+    struct stat st;
+    bool from_file = !from_opaque && fstat(from, &st) == 0 && S_ISREG(st.st_mode);
+    bool from_fifo = from == splice_fd;
+    path->append = to == append_fd;
+    bool opaque = capture == NULL && trace == NULL && path->adaptor == ADAPTOR_NONE && path->to_channel == NULL &&
+                  !path->append;
+    if (opaque && to_type == SOCK_STREAM && from_file)
+        path->transfer = TRANSFER_SENDFILE;
+    else if (opaque && to_type == SOCK_STREAM && from_fifo)
+        path->transfer = TRANSFER_SPLICE;
+    else if (from_file && st.st_size > 0)
+    {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, from, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            path->mapped = (char *)map;
+            path->mapped_size = st.st_size;
+            path->mapped_offset = lseek(from, 0, SEEK_CUR);
+        }
+    }
+    if (path->append)
+    {
+        // O_DIRECT needs the buffer, the length and the file offset aligned
+        void *staging;
+        if (posix_memalign(&staging, FILE_DIRECT_ALIGN, FILE_APPEND_SIZE) != 0)
+        {
+            perror("malloc");
+            closeResourcesAndExit(EXIT_FAILURE);
+        }
+        path->staging = (char *)staging;
+        path->direct = append_direct;
+        path->file_end = lseek(to, 0, SEEK_END);
+    }
+    LOG_DEBUG("Relay %c from %d to %d, coalesce: %d, zerocopy: %d, timestamps: %d/%d, adaptor: %d, transfer: %d, mapped: %zu, append: %d\n",
+              direction, from, to, path->coalesce, path->zerocopy, path->rx_timestamps, path->tx_timestamps, path->adaptor,
+              path->transfer, path->mapped_size, path->append);
+}
+
+/**
+ * relay_reap: Reads the error queue of the destination. MSG_ZEROCOPY completions release the
+ *             buffers whose sends are all complete, and TX timestamps complete the pending
+ *             trace records, which are matched in the order of the sampled sends.
+ * @param wait: true to block until at least one zero-copy completion was read.
+ */
+void relay_reap(struct relay_path *path, bool wait)
+{
+    while (path->inflight > 0 || path->npending > 0)
+    {
+        char control[CMSG_SPACE(sizeof(struct scm_timestamping)) +
+                     CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(path->to, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN || !wait || path->inflight == 0)
+                return;
+            // The error queue is signalled as POLLERR
+            struct pollfd pfd;
+            pfd.fd = path->to;
+            pfd.events = 0;
+            if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+                return;
+            continue;
+        }
+
+        struct sock_extended_err *err = NULL;
+        struct scm_timestamping *stamps = NULL;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+                stamps = (struct scm_timestamping *)CMSG_DATA(cmsg);
+            else if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                     (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+        }
+        if (err == NULL)
+            continue;
+        if (err->ee_errno == ENOMSG && err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING && stamps != NULL && path->npending > 0)
+        {
+            struct trace_record *record = &path->pending[path->pending_first];
+            record->tx_kernel_ns = (uint64_t)stamps->ts[0].tv_sec * 1000000000ull + stamps->ts[0].tv_nsec;
+            trace_finish(record);
+            path->pending_first = (path->pending_first + 1) % TRACE_PENDING;
+            path->npending--;
+        }
+        else if (err->ee_errno == 0 && err->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+        {
+            // ee_info..ee_data is the range of completed sends
+            for (uint32_t sequence = err->ee_info; sequence != err->ee_data + 1; sequence++)
+            {
+                path->buffers[path->sequence_owner[sequence % ZEROCOPY_MAX_INFLIGHT]].inflight--;
+                path->inflight--;
+            }
+            wait = false;
+        }
+    }
+}
+
+/**
+ * relay_receive: Reads the first message of a chunk. For a sampled chunk it also takes the
+ *                kernel's RX timestamp and the time mync got the data.
+ */
+ssize_t relay_receive(struct relay_path *path, char *data, size_t length)
+{
+    if (!path->sampled || !path->rx_timestamps)
+    {
+        ssize_t size;
+        if (path->from_channel != NULL)
+            size = shm_read(path->from_channel, data, length, path->peer_gone);
+        else if (path->from_reliable)
+            size = rel_read(reliable, data, length);
+        else
+            size = read(path->from, data, length);
+        path->sample.rx_user_ns = path->sampled ? realtime_ns() : 0;
+        return size;
+    }
+
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = length;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t size = recvmsg(path->from, &msg, 0);
+    path->sample.rx_user_ns = realtime_ns();
+    if (size <= 0)
+        return size;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+        {
+            struct scm_timestamping *stamps = (struct scm_timestamping *)CMSG_DATA(cmsg);
+            path->sample.rx_kernel_ns = (uint64_t)stamps->ts[0].tv_sec * 1000000000ull + stamps->ts[0].tv_nsec;
+        }
+    }
+    return size;
+}
+
+/**
+ * relay_mapped: Takes the next chunk of a mapped file source without copying it.
+ * @param data: Receives the start of the chunk in the mapping.
+ * @param limit: The longest chunk.
+ * @return The length of the chunk, 0 at the end of the file.
+ */
+ssize_t relay_mapped(struct relay_path *path, char **data, size_t limit)
+{
+    size_t size = path->mapped_size - path->mapped_offset;
+    if (size > limit)
+        size = limit;
+    *data = path->mapped + path->mapped_offset;
+    path->mapped_offset += size;
+    if (path->sampled)
+        path->sample.rx_user_ns = realtime_ns();
+    return size;
+}
+
+/**
+ * relay_transfer: Moves the next chunk of a path inside the kernel, with sendfile() from a
+ *                 file or splice() from a FIFO. A filesystem or socket that does not support
+ *                 it makes the path fall back to copying.
+ * @return The number of bytes moved, 0 at end of file, or -1 on failure.
+ */
+ssize_t relay_transfer(struct relay_path *path)
+{
+    ssize_t size = path->transfer == TRANSFER_SENDFILE ? sendfile(path->to, path->from, NULL, FILE_CHUNK_SIZE)
+                                                       : splice(path->from, NULL, path->to, NULL, FILE_CHUNK_SIZE, SPLICE_F_MOVE);
+    if (size == -1 && errno == EINVAL)
+    {
+        LOG_INFO("Relay %c cannot move data in the kernel, copying it\n", path->direction);
+        path->transfer = TRANSFER_COPY;
+        errno = EAGAIN;
+    }
+    return size;
+}
+
+/**
+ * relay_trace_sent: Completes the trace record of a sampled chunk after it was sent. Without TX
+ *                   timestamps the record is finished at once, otherwise it waits in pending.
+ */
+void relay_trace_sent(struct relay_path *path)
+{
+    if (path->direction == 'I')
+        trace->command_sent_ns = path->sample.tx_user_ns;
+    if (!path->tx_timestamps)
+    {
+        trace_finish(&path->sample);
+        return;
+    }
+    if (path->npending == TRACE_PENDING)
+    {
+        // The oldest timestamp is overdue, finish its record without it
+        trace_finish(&path->pending[path->pending_first]);
+        path->pending_first = (path->pending_first + 1) % TRACE_PENDING;
+        path->npending--;
+    }
+    path->pending[(path->pending_first + path->npending) % TRACE_PENDING] = path->sample;
+    path->npending++;
+    relay_reap(path, false);
+}
+
+/**
+ * relay_read: Reads the next chunk of a path into its current buffer and captures it.
+ *             When messages are coalesced, the messages that are already queued are read
+ *             too, each into its own iovec.
+ * @param iov: Receives the iovecs of the messages.
+ * @param niov: Receives the number of iovecs.
+ * @param eof: Set when the source ended after the returned data.
+ * @return The number of bytes read, 0 at end of file, or -1 on failure.
+ */
+ssize_t relay_read(struct relay_path *path, struct iovec *iov, int *niov, bool *eof)
+{
+    struct relay_buffer *buffer = &path->buffers[path->current];
+    if (buffer->inflight > 0 || path->npending > 0)
+        relay_reap(path, false);
+    while (buffer->inflight > 0)
+        relay_reap(path, true);
+
+    path->sampled = trace_sample();
+    if (path->sampled)
+        memset(&path->sample, 0, sizeof(path->sample));
+    *niov = 0;
+    *eof = false;
+    size_t total = 0;
+    // What goes to the reliable datagrams is read only as far as their window reaches, what
+    // comes from them only as much as a writable destination takes without blocking
+    size_t limit = RELAY_BUFFER_SIZE;
+    if (path->to_reliable && rel_room(reliable) < limit)
+        limit = rel_room(reliable);
+    if (path->to_channel != NULL && shm_room(path->to_channel) < limit)
+        limit = shm_room(path->to_channel);
+    if (path->from_reliable)
+        limit = path->delivery_size;
+    while (*niov < RELAY_MAX_IOV && total < limit)
+    {
+        ssize_t size;
+        char *data = buffer->data + total;
+        if (*niov == 0 && path->mapped != NULL)
+            size = relay_mapped(path, &data, limit);
+        else if (*niov == 0)
+            size = relay_receive(path, data, limit);
+        else
+            size = recv(path->from, data, limit - total, MSG_DONTWAIT);
+        // An empty datagram carries nothing, only a stream ends with a 0 byte read
+        if (size == 0 && path->from_datagrams)
+        {
+            if (*niov > 0)
+                continue;
+            return 0;
+        }
+        if (size <= 0)
+        {
+            if (*niov == 0)
+                return size;
+            if (size == 0)
+                *eof = true;
+            break;
+        }
+        capture_chunk(path->direction, data, size);
+        iov[*niov].iov_base = data;
+        iov[*niov].iov_len = size;
+        (*niov)++;
+        total += size;
+        if (!path->coalesce)
+            break;
+    }
+    if (trace != NULL && path->direction == 'O' && trace->command_sent_ns != 0)
+    {
+        // The first output of the command after a traced input
+        uint64_t now = path->sampled ? path->sample.rx_user_ns : realtime_ns();
+        if (now > trace->command_sent_ns)
+            latency_record(&trace->command, now - trace->command_sent_ns);
+        trace->command_sent_ns = 0;
+    }
+    path->sample.direction = path->direction;
+    path->sample.length = total;
+    return total;
+}
+
+/**
+ * relay_send: Sends the iovecs read by relay_read() with one vectored call, using
+ *             MSG_ZEROCOPY for large chunks. Chunks below the threshold, and chunks the kernel
+ *             cannot pin memory for, are copied as usual.
+ * @return 0 on success, -1 on failure.
+ */
+int relay_send(struct relay_path *path, struct iovec *iov, int niov, size_t total)
+{
+    bool zerocopy = path->zerocopy && total >= zerocopy_threshold;
+    struct relay_buffer *buffer = &path->buffers[path->current];
+    // A sampled chunk asks for the TX timestamp of its first send
+    bool timestamp = path->sampled && path->tx_timestamps;
+    if (path->sampled)
+        path->sample.tx_user_ns = realtime_ns();
+    if (path->to_channel != NULL)
+    {
+        // The chunk was only read once the ring had room for it, see relay_paths()
+        for (int i = 0; i < niov; i++)
+        {
+            if (shm_write(path->to_channel, (const char *)iov[i].iov_base, iov[i].iov_len) != (ssize_t)iov[i].iov_len)
+            {
+                errno = EAGAIN;
+                return -1;
+            }
+        }
+        niov = 0;
+    }
+    if (path->to_reliable)
+    {
+        for (int i = 0; i < niov; i++)
+        {
+            if (rel_write(reliable, (const char *)iov[i].iov_base, iov[i].iov_len) == -1)
+                return -1;
+        }
+        niov = 0;
+    }
+    while (niov > 0)
+    {
+        if (zerocopy && path->inflight >= ZEROCOPY_MAX_INFLIGHT)
+            relay_reap(path, true);
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = niov;
+        char control[CMSG_SPACE(sizeof(uint32_t))];
+        if (timestamp)
+        {
+            memset(control, 0, sizeof(control));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SO_TIMESTAMPING;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+            *(uint32_t *)CMSG_DATA(cmsg) = SOF_TIMESTAMPING_TX_SOFTWARE;
+        }
+        ssize_t sent = (path->nbuffers > 1 || niov > 1 || timestamp) ? sendmsg(path->to, &msg, MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0))
+                                                                     : write(path->to, iov[0].iov_base, iov[0].iov_len);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (zerocopy && errno == ENOBUFS)
+            {
+                zerocopy = false;
+                continue;
+            }
+            return -1;
+        }
+        timestamp = false;
+        if (zerocopy)
+        {
+            path->sequence_owner[path->next_sequence++ % ZEROCOPY_MAX_INFLIGHT] = path->current;
+            buffer->inflight++;
+            path->inflight++;
+        }
+
+        // Skip what was sent, a partial send leaves the rest for the next call
+        while (niov > 0 && (size_t)sent >= iov->iov_len)
+        {
+            sent -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    if (buffer->inflight > 0)
+        path->current = (path->current + 1) % path->nbuffers;
+    if (path->sampled)
+        relay_trace_sent(path);
+    // Further datagrams cut from the same chunk are not traced again
+    path->sampled = false;
+    return 0;
+}
+
+/**
+ * relay_flush_staged: Sends the staged data of a stream that is converted to datagrams.
+ *                     Packed data goes out in full datagrams, frames go out once complete.
+ * @param all: Also send a partial datagram, at the flush deadline or the end of the stream.
+ *             A partial frame at the end of the stream is dropped.
+ * @return 0 on success, -1 on failure.
+ */
+int relay_flush_staged(struct relay_path *path, bool all)
+{
+    size_t offset = 0;
+    while (offset < path->staged)
+    {
+        size_t available = path->staged - offset;
+        struct iovec iov;
+        if (path->skip > 0)
+        {
+            size_t skipped = available < path->skip ? available : path->skip;
+            offset += skipped;
+            path->skip -= skipped;
+            continue;
+        }
+        if (path->adaptor == ADAPTOR_DATAGRAMS)
+        {
+            if (available < path->datagram_size && !all)
+                break;
+            iov.iov_base = path->staging + offset;
+            iov.iov_len = available < path->datagram_size ? available : path->datagram_size;
+            offset += iov.iov_len;
+        }
+        else
+        {
+            uint32_t length;
+            if (available < FRAME_HEADER_SIZE)
+                break;
+            memcpy(&length, path->staging + offset, sizeof(length));
+            length = ntohl(length);
+            // A frame that no datagram can carry is skipped as it arrives, the path goes on
+            if (length > path->datagram_size)
+            {
+                LOG_INFO("Dropping a frame of %u bytes, more than a datagram carries (%zu)\n", length, path->datagram_size);
+                offset += FRAME_HEADER_SIZE;
+                path->skip = length;
+                continue;
+            }
+            if (available < FRAME_HEADER_SIZE + length)
+                break;
+            iov.iov_base = path->staging + offset + FRAME_HEADER_SIZE;
+            iov.iov_len = length;
+            offset += FRAME_HEADER_SIZE + length;
+        }
+        if (relay_send(path, &iov, 1, iov.iov_len) == -1)
+            return -1;
+    }
+    if (all && path->adaptor == ADAPTOR_DEFRAME && offset < path->staged)
+    {
+        LOG_INFO("Dropping a partial frame of %zu bytes\n", path->staged - offset);
+        offset = path->staged;
+    }
+    memmove(path->staging, path->staging + offset, path->staged - offset);
+    path->staged -= offset;
+    if (path->staged == 0)
+        path->flush_ns = 0;
+    return 0;
+}
+
+/**
+ * relay_set_direct: Turns O_DIRECT on or off for the next writes to the output file.
+ * @return 0 on success, -1 on failure.
+ */
+int relay_set_direct(struct relay_path *path, bool direct)
+{
+    int flags = fcntl(path->to, F_GETFL);
+    if (flags == -1)
+        return -1;
+    if (((flags & O_DIRECT) != 0) == direct)
+        return 0;
+    return fcntl(path->to, F_SETFL, direct ? flags | O_DIRECT : flags & ~O_DIRECT);
+}
+
+/**
+ * relay_flush_file: Appends the staged data to the output file. With O_DIRECT only whole
+ *                   aligned blocks are written directly. The bytes that bring the end of the
+ *                   file to a block boundary, and the rest at a flush, go through the page cache.
+ * @param all: Also write a partial block, at the flush deadline or the end of the stream.
+ * @return 0 on success, -1 on failure.
+ */
+int relay_flush_file(struct relay_path *path, bool all)
+{
+    while (path->staged > 0)
+    {
+        size_t length = path->staged;
+        bool direct = false;
+        if (path->direct && path->file_end % FILE_DIRECT_ALIGN != 0)
+        {
+            size_t align = FILE_DIRECT_ALIGN - path->file_end % FILE_DIRECT_ALIGN;
+            length = length < align ? length : align;
+        }
+        else if (path->direct && length >= FILE_DIRECT_ALIGN)
+        {
+            length -= length % FILE_DIRECT_ALIGN;
+            direct = true;
+        }
+        else if (path->direct && !all)
+            break;
+        if (path->direct && relay_set_direct(path, direct) == -1)
+        {
+            perror("Failed to set O_DIRECT");
+            return -1;
+        }
+
+        ssize_t written = write(path->to, path->staging, length);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to write file");
+            return -1;
+        }
+        memmove(path->staging, path->staging + written, path->staged - written);
+        path->staged -= written;
+        path->file_end += written;
+    }
+    if (path->staged == 0)
+        path->flush_ns = 0;
+    return 0;
+}
+
+/**
+ * relay_flush: Sends what a path holds back, the adaptor's datagrams or the file's appends.
+ * @param all: Also send a partial datagram or block.
+ * @return 0 on success, -1 on failure.
+ */
+int relay_flush(struct relay_path *path, bool all)
+{
+    return path->append ? relay_flush_file(path, all) : relay_flush_staged(path, all);
+}
+
+/**
+ * relay_forward: Sends a chunk read by relay_read() through the path's adaptor, or stages it
+ *                for the output file.
+ * @return 0 on success, -1 on failure.
+ */
+int relay_forward(struct relay_path *path, struct iovec *iov, int niov, size_t total)
+{
+    if (path->append)
+    {
+        for (int i = 0; i < niov; i++)
+        {
+            const char *data = (const char *)iov[i].iov_base;
+            size_t length = iov[i].iov_len;
+            while (length > 0)
+            {
+                size_t copied = FILE_APPEND_SIZE - path->staged < length ? FILE_APPEND_SIZE - path->staged : length;
+                memcpy(path->staging + path->staged, data, copied);
+                path->staged += copied;
+                data += copied;
+                length -= copied;
+                if (path->staged == FILE_APPEND_SIZE && relay_flush_file(path, false) == -1)
+                    return -1;
+            }
+        }
+        if (path->staged > 0 && path->flush_ns == 0)
+            path->flush_ns = monotonic_ns() + FILE_FLUSH_NS;
+        return 0;
+    }
+    if (path->adaptor == ADAPTOR_NONE)
+        return relay_send(path, iov, niov, total);
+
+    if (path->adaptor == ADAPTOR_FRAME)
+    {
+        // The headers live with the buffer, a zero-copy send still reads them after returning
+        struct relay_buffer *buffer = &path->buffers[path->current];
+        struct iovec framed[2 * RELAY_MAX_IOV];
+        for (int i = 0; i < niov; i++)
+        {
+            buffer->headers[i] = htonl(iov[i].iov_len);
+            framed[2 * i].iov_base = &buffer->headers[i];
+            framed[2 * i].iov_len = FRAME_HEADER_SIZE;
+            framed[2 * i + 1] = iov[i];
+        }
+        return relay_send(path, framed, 2 * niov, total + niov * FRAME_HEADER_SIZE);
+    }
+
+    for (int i = 0; i < niov; i++)
+    {
+        const char *data = (const char *)iov[i].iov_base;
+        size_t length = iov[i].iov_len;
+        while (length > 0)
+        {
+            size_t space = RELAY_BUFFER_SIZE + FRAME_HEADER_SIZE - path->staged;
+            size_t copied = length < space ? length : space;
+            memcpy(path->staging + path->staged, data, copied);
+            path->staged += copied;
+            data += copied;
+            length -= copied;
+            if (relay_flush_staged(path, false) == -1)
+                return -1;
+        }
+    }
+    if (path->staged > 0 && path->flush_ns == 0)
+    {
+        if (flush_deadline_us == 0)
+            return relay_flush_staged(path, true);
+        path->flush_ns = monotonic_ns() + flush_deadline_us * 1000ull;
+    }
+    return 0;
+}
+
+/**
+ * relay_paths: Copies data along several paths until the last path reaches end of file.
+ *              Every chunk is captured before it is written. When an earlier path ends
+ *              its destination is closed, so a command sees end of file on its stdin.
+ * @param paths: The paths, the last one is the one that ends the relay.
+ * @param npaths: The number of paths.
+ * @param time: The inactivity timeout in seconds that is re-armed after each chunk, or 0.
+ */
+void relay_paths(struct relay_path *paths, int npaths, unsigned int time)
+{
+    signal(SIGPIPE, SIG_IGN);
+    while (paths[npaths - 1].open)
+    {
+        // A shared-memory source waits on its eventfd, and on its handshake socket for the peer's exit.
+        // A path to a full ring waits on the ring's space eventfd instead of its source, so shm_write()
+        // never blocks and the other direction keeps being drained.
+        // The reliable datagrams' socket is watched once at the end, its paths read what it received
+        struct pollfd pfds[2 * 4 + 1];
+        uint64_t flush_ns = reliable != NULL ? rel_deadline(reliable) : 0;
+        bool ready = false;
+        bool space_wait[4] = {false, false, false, false};
+        for (int i = 0; i < npaths; i++)
+        {
+            struct shm_channel *channel = paths[i].open ? paths[i].from_channel : NULL;
+            pfds[i].fd = paths[i].open && !paths[i].from_reliable ? (channel != NULL ? channel->data_fd : paths[i].from) : -1;
+            pfds[i].events = POLLIN;
+            // A source waits while the reliable datagrams' window is full, so rel_write() never blocks,
+            // and received data waits for its destination, so the relay keeps answering the peer
+            if (paths[i].to_reliable && rel_room(reliable) == 0)
+                pfds[i].fd = -1;
+            if (paths[i].open && paths[i].from_reliable && rel_readable(reliable))
+            {
+                pfds[i].fd = paths[i].to;
+                pfds[i].events = POLLOUT;
+            }
+            pfds[npaths + i].fd = channel != NULL ? shm->sock : -1;
+            pfds[npaths + i].events = POLLIN;
+            if (channel != NULL && shm_prepare_wait(channel))
+                ready = true;
+            if (paths[i].open && paths[i].to_channel != NULL && !shm_prepare_space(paths[i].to_channel))
+            {
+                space_wait[i] = true;
+                pfds[i].fd = paths[i].to_channel->space_fd;
+                pfds[npaths + i].fd = shm->sock;
+            }
+            if (paths[i].flush_ns != 0 && (flush_ns == 0 || paths[i].flush_ns < flush_ns))
+                flush_ns = paths[i].flush_ns;
+        }
+        pfds[2 * npaths].fd = reliable != NULL ? reliable->fd : -1;
+        pfds[2 * npaths].events = POLLIN;
+        // Wait for data, or until the first adaptor deadline or retransmission
+        struct timespec timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_nsec = 0;
+        if (flush_ns != 0 && !ready)
+        {
+            uint64_t now = monotonic_ns();
+            uint64_t wait_ns = flush_ns > now ? flush_ns - now : 0;
+            timeout.tv_sec = wait_ns / 1000000000ull;
+            timeout.tv_nsec = wait_ns % 1000000000ull;
+        }
+        int polled = ppoll(pfds, 2 * npaths + 1, (flush_ns != 0 || ready) ? &timeout : NULL, NULL);
+        bool reliable_failed = false;
+        if (reliable != NULL)
+        {
+            rel_input(reliable);
+            reliable_failed = rel_tick(reliable) == -1;
+            for (int i = 0; i < npaths; i++)
+            {
+                if (paths[i].from_reliable)
+                    pfds[i].revents = rel_readable(reliable) && polled > 0 && pfds[i].revents ? POLLIN : 0;
+            }
+        }
+        bool failed[4] = {false, false, false, false};
+        for (int i = 0; i < npaths; i++)
+        {
+            if (!space_wait[i])
+                continue;
+            shm_finish_space(paths[i].to_channel);
+            // The consumer exited while its ring is full, nothing will make room any more
+            if (polled > 0 && pfds[npaths + i].revents && shm_room(paths[i].to_channel) < RELAY_BUFFER_SIZE)
+            {
+                errno = EPIPE;
+                failed[i] = true;
+            }
+            pfds[i].revents = 0;
+        }
+        for (int i = 0; i < npaths; i++)
+        {
+            struct shm_channel *channel = paths[i].open ? paths[i].from_channel : NULL;
+            if (channel == NULL)
+                continue;
+            shm_finish_wait(channel);
+            if (polled != -1 && pfds[npaths + i].revents)
+                paths[i].peer_gone = true;
+            pfds[i].revents = (!space_wait[i] && (shm_readable(channel) || paths[i].peer_gone)) ? POLLIN : 0;
+        }
+        if (polled == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        uint64_t now = monotonic_ns();
+        for (int i = 0; i < npaths; i++)
+        {
+            if (paths[i].flush_ns != 0 && paths[i].flush_ns <= now)
+                failed[i] = relay_flush(&paths[i], true) == -1;
+            if (reliable_failed && paths[i].open && (paths[i].from_reliable || paths[i].to_reliable))
+                failed[i] = true;
+        }
+
+        for (int i = 0; i < npaths; i++)
+        {
+            if (pfds[i].revents == 0 && !failed[i])
+                continue;
+            struct iovec iov[RELAY_MAX_IOV];
+            int niov;
+            bool eof = false;
+            ssize_t size;
+            if (failed[i])
+                size = -1;
+            else if (paths[i].transfer != TRANSFER_COPY)
+                size = relay_transfer(&paths[i]);
+            else
+                size = relay_read(&paths[i], iov, &niov, &eof);
+            if (size == -1 && (errno == EINTR || errno == EAGAIN) && !failed[i])
+                continue;
+            // An empty datagram carries nothing, only a stream ends with a 0 byte read
+            if (size == 0 && paths[i].from_datagrams)
+                continue;
+            bool transferred = paths[i].transfer != TRANSFER_COPY;
+            if (size > 0 && (transferred || relay_forward(&paths[i], iov, niov, size) == 0))
+            {
+                if (time)
+                    alarm(time);
+                if (!eof)
+                    continue;
+            }
+            if (paths[i].staged > 0 && !failed[i])
+                relay_flush(&paths[i], true);
+            paths[i].staged = 0;
+            paths[i].flush_ns = 0;
+            paths[i].open = false;
+            if (paths[i].to_channel != NULL)
+                shm_close(paths[i].to_channel);
+            else if (paths[i].to_reliable)
+            {
+                if (!reliable_failed)
+                    rel_close(reliable);
+            }
+            else if (i < npaths - 1 && paths[i].to != STDOUT_FILENO)
+                close(paths[i].to);
+        }
+        // One acknowledgement for what this round received, unless data going back carried it
+        if (reliable != NULL && reliable->ack_pending)
+            rel_send_ack(reliable, 0);
+    }
+
+    if (reliable != NULL)
+    {
+        // Stay until the peer has everything, the FIN included
+        if (rel_wait(reliable, true, monotonic_ns() + REL_LINGER_NS) == -1)
+            LOG_INFO("Reliable datagrams: %u packets not acknowledged\n", reliable->snd_nxt - reliable->snd_una);
+        else
+            rel_quiesce(reliable);
+        LOG_INFO("Reliable datagrams: %llu retransmitted on timeout, %llu fast retransmits, rtt %.1f us\n",
+                 (unsigned long long)reliable->retransmits, (unsigned long long)reliable->fast_retransmits,
+                 reliable->srtt_ns / 1000.0);
+    }
+
+    if (trace != NULL)
+    {
+        // The last TX timestamps may still be on their way (Nagle holds back small segments),
+        // chunks whose timestamp did not arrive in time are reported without it
+        for (int i = 0; i < npaths; i++)
+        {
+            uint64_t deadline_ns = monotonic_ns() + TRACE_DRAIN_NS;
+            relay_reap(&paths[i], false);
+            while (paths[i].npending > 0 && monotonic_ns() < deadline_ns)
+            {
+                struct pollfd pfd;
+                pfd.fd = paths[i].to;
+                pfd.events = 0;
+                if (poll(&pfd, 1, 10) == -1 || (pfd.revents & POLLNVAL))
+                    break;
+                relay_reap(&paths[i], false);
+            }
+            for (; paths[i].npending > 0; paths[i].npending--)
+            {
+                trace_finish(&paths[i].pending[paths[i].pending_first]);
+                paths[i].pending_first = (paths[i].pending_first + 1) % TRACE_PENDING;
+            }
+        }
+        trace_report();
+    }
+}
+
+/**
+ * spawn_command: Runs a command in a child process with the given stdin and stdout.
+ *                The child is recorded in the child global so it is killed on exit.
+ * @param command: The command to run with the shell.
+ * @param stdin_fd: The fd that becomes the command's stdin.
+ * @param stdout_fd: The fd that becomes the command's stdout.
+ * @param parent_fds: Fds of the parent that the child must not keep open, -1 terminated.
+ */
+void spawn_command(const char *command, int stdin_fd, int stdout_fd, const int *parent_fds)
+{
+    fflush(stdout);
+    child = fork();
+    if (child == -1)
+    {
+        perror("fork");
+        child = 0;
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    if (child == 0)
+    {
+        if (dup2(stdin_fd, STDIN_FILENO) == -1 || dup2(stdout_fd, STDOUT_FILENO) == -1)
+        {
+            perror("dup2");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; parent_fds[i] != -1; i++)
+        {
+            if (parent_fds[i] > STDERR_FILENO)
+                close(parent_fds[i]);
+        }
+        executeCommand(command);
+    }
+}
+
+/**
+ * run_command_relayed: Runs the command on pipes and relays its stdin and stdout through
+ *                      this process, so every chunk that crosses input_fd and output_fd
+ *                      can be captured.
+ * @param command: The command to run.
+ * @param time: The inactivity timeout in seconds, or 0.
+ */
+void run_command_relayed(const char *command, unsigned int time)
+{
+    int to_child[2];
+    int from_child[2];
+    if (pipe2(to_child, O_CLOEXEC) == -1 || pipe2(from_child, O_CLOEXEC) == -1)
+    {
+        perror("pipe");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    int parent_fds[] = {to_child[1], from_child[0], input_fd, output_fd, -1};
+    spawn_command(command, to_child[0], from_child[1], parent_fds);
+    close(to_child[0]);
+    close(from_child[1]);
+
+    static struct relay_path paths[2];
+    relay_path_init(&paths[0], input_fd, to_child[1], 'I');
+    relay_path_init(&paths[1], from_child[0], output_fd, 'O');
+    relay_paths(paths, 2, time);
+
+    int status;
+    waitpid(child, &status, 0);
+    child = 0;
+    closeResourcesAndExit(WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
+}
+
+/**
+ * replay_capture: Writes the chunks of one direction of a capture file to an fd,
+ *                 one write per chunk, keeping their original spacing divided by speed.
+ * @param path: The capture file.
+ * @param speed: 1 for the original speed, N for N times faster, 0 for as fast as possible.
+ * @param direction: The direction to replay, 'I' or 'O'.
+ * @param fd: The fd to write the chunks to.
+ */
+void replay_capture(const char *path, double speed, char direction, int fd)
+{
+    int capture_fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (capture_fd == -1 || fstat(capture_fd, &st) == -1)
+    {
+        perror("Failed to open capture file");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    if ((size_t)st.st_size < sizeof(struct capture_header))
+    {
+        fprintf(stderr, "Not a capture file: %s\n", path);
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, capture_fd, 0);
+    close(capture_fd);
+    if (map == MAP_FAILED)
+    {
+        perror("Failed to map capture file");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    const struct capture_header *header = (const struct capture_header *)map;
+    const char *data = (const char *)map + sizeof(struct capture_header);
+    if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0 ||
+        sizeof(struct capture_header) + header->capacity > (uint64_t)st.st_size)
+    {
+        fprintf(stderr, "Not a capture file: %s\n", path);
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    LOG_INFO("Replaying %llu records from %s\n", (unsigned long long)header->records, path);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Oldest records first: the upper segment of a wrapped ring, then the lower one
+    uint64_t segment_start[2] = {header->tail, 0};
+    uint64_t segment_end[2] = {header->wrapped ? header->wrap_end : header->head, header->wrapped ? header->head : 0};
+    uint64_t first_ns = 0;
+    uint64_t start_ns = monotonic_ns();
+    for (int segment = 0; segment < 2; segment++)
+    {
+        uint64_t offset = segment_start[segment];
+        while (offset + sizeof(struct capture_record) <= segment_end[segment])
+        {
+            const struct capture_record *record = (const struct capture_record *)(data + offset);
+            offset += capture_record_size(record->length);
+            if (offset > segment_end[segment] || record->direction != direction)
+                continue;
+
+            if (first_ns == 0)
+                first_ns = record->timestamp_ns;
+            if (speed > 0)
+            {
+                uint64_t due_ns = start_ns + (uint64_t)((record->timestamp_ns - first_ns) / speed);
+                struct timespec due;
+                due.tv_sec = due_ns / 1000000000ull;
+                due.tv_nsec = due_ns % 1000000000ull;
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+                    ;
+            }
+            if (write_all(fd, (const char *)(record + 1), record->length) == -1)
+            {
+                perror("Failed to replay chunk");
+                closeResourcesAndExit(EXIT_FAILURE);
+            }
+        }
+    }
+    munmap(map, st.st_size);
+}
+
+#define POOL_MAX_CONNECTIONS 256
+#define POOL_MAINTAIN_INTERVAL_NS 1000000000ull
+
+/**
+ * Settings of an upstream connection pool, given as -P warm=N,idle=seconds,max=N.
+ */
+struct pool_config
+{
+    unsigned int warm;
+    unsigned int idle_seconds;
+    unsigned int max;
+};
+
+/**
+ * Pre-warmed connections to one TCP upstream, owned by a worker. A session borrows a connection
+ * when it is forked and the worker closes its copy of the fd when the session exits. A
+ * connection is lent only once: the sessions have no end marker, so a connection that carried
+ * a session may still be in the middle of it (a ttt game that the client left) and cannot
+ * carry another one. Idle connections are ordered by the time they were opened.
+ * lent + nidle never exceeds config.max.
+ */
+struct upstream_pool
+{
+    char *hostname;
+    int port;
+    char flag;
+    struct pool_config config;
+    int idle[POOL_MAX_CONNECTIONS];
+    uint64_t idle_since_ns[POOL_MAX_CONNECTIONS];
+    unsigned int nidle;
+    unsigned int lent;
+};
+
+int parse_pool_config(char *spec, struct pool_config *config)
+{
+    config->warm = 4;
+    config->idle_seconds = 60;
+    config->max = 64;
+
+    for (char *item = strtok(spec, ","); item != NULL; item = strtok(NULL, ","))
+    {
+        char *value = strchr(item, '=');
+        if (value == NULL)
+            return -1;
+        *value++ = '\0';
+        if (strcmp(item, "warm") == 0)
+            config->warm = atoi(value);
+        else if (strcmp(item, "idle") == 0)
+            config->idle_seconds = atoi(value);
+        else if (strcmp(item, "max") == 0)
+            config->max = atoi(value);
+        else
+            return -1;
+    }
+    if (config->max == 0 || config->max > POOL_MAX_CONNECTIONS || config->warm > config->max || config->idle_seconds == 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * pool_connect: Opens a new connection to the upstream.
+ * @return The connected socket, or -1 if the upstream could not be reached.
+ */
+int pool_connect(struct upstream_pool *pool)
+{
+    int fd = connect_tcp(pool->hostname, pool->port);
+    if (fd == -1)
+    {
+        LOG_INFO("Upstream %s:%d unreachable: %s\n", pool->hostname ?: "localhost", pool->port, strerror(errno));
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    LOG_DEBUG("Opened upstream connection %d\n", fd);
+    return fd;
+}
+
+/**
+ * pool_healthy: Checks an idle connection. End of file or an error means the upstream dropped
+ *               it, and data that the upstream sent before any session does not belong to one.
+ */
+bool pool_healthy(int fd)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) == 0;
+}
+
+bool pool_exhausted(const struct upstream_pool *pool)
+{
+    return pool->nidle == 0 && pool->lent >= pool->config.max;
+}
+
+/**
+ * pool_borrow: Lends a healthy warm connection, or opens a new one below the limit.
+ * @return The connection, or -1 if the pool is exhausted or the upstream is unreachable.
+ */
+int pool_borrow(struct upstream_pool *pool)
+{
+    while (pool->nidle > 0)
+    {
+        int fd = pool->idle[--pool->nidle];
+        if (pool_healthy(fd))
+        {
+            pool->lent++;
+            return fd;
+        }
+        LOG_DEBUG("Dropping stale upstream connection %d\n", fd);
+        close(fd);
+    }
+    if (pool->lent >= pool->config.max)
+        return -1;
+    int fd = pool_connect(pool);
+    if (fd != -1)
+        pool->lent++;
+    return fd;
+}
+
+/**
+ * pool_return: Closes a connection when its session ended, which frees its place below
+ *              config.max. Even a session that exited successfully may have left the upstream
+ *              in the middle of a conversation, so a used connection is never lent again.
+ */
+void pool_return(struct upstream_pool *pool, int fd)
+{
+    pool->lent--;
+    LOG_DEBUG("Closing upstream connection %d\n", fd);
+    close(fd);
+}
+
+/**
+ * pool_maintain: Closes idle connections that are older than the idle limit or were dropped by
+ *                the upstream, then opens connections until config.warm of them are idle.
+ */
+void pool_maintain(struct upstream_pool *pool)
+{
+    uint64_t now = monotonic_ns();
+    uint64_t idle_ns = (uint64_t)pool->config.idle_seconds * 1000000000ull;
+    unsigned int kept = 0;
+    for (unsigned int i = 0; i < pool->nidle; i++)
+    {
+        if (now - pool->idle_since_ns[i] >= idle_ns || !pool_healthy(pool->idle[i]))
+        {
+            LOG_DEBUG("Closing idle upstream connection %d\n", pool->idle[i]);
+            close(pool->idle[i]);
+            continue;
+        }
+        pool->idle[kept] = pool->idle[i];
+        pool->idle_since_ns[kept] = pool->idle_since_ns[i];
+        kept++;
+    }
+    pool->nidle = kept;
+
+    while (pool->nidle < pool->config.warm && pool->lent + pool->nidle < pool->config.max)
+    {
+        int fd = pool_connect(pool);
+        if (fd == -1)
+            break;
+        pool->idle[pool->nidle] = fd;
+        pool->idle_since_ns[pool->nidle] = now;
+        pool->nidle++;
+    }
+}
+
+#define GROUP_MAX_BACKENDS 32
+#define GROUP_VNODES 64
+#define GROUP_CONNECT_TIMEOUT_MS 1000
+#define GROUP_EJECT_NS 5000000000ull
+#define GROUP_PROBE_INTERVAL_NS 1000000000ull
+
+enum group_policy
+{
+    GROUP_ROUND_ROBIN,
+    GROUP_LEAST_CONNECTIONS,
+    GROUP_CONSISTENT_HASH
+};
+
+/**
+ * A backend of a group. A backend that failed a connect is ejected until ejected_until_ns,
+ * then the next session that picks it is its health check. With probes a worker also
+ * connects to it every second while it is ejected (probe_fd, -1 when no probe is running)
+ * and readmits it as soon as one succeeds.
+ */
+struct backend
+{
+    char *name;
+    struct client_target target;
+    unsigned int active;
+    uint64_t ejected_until_ns;
+    int probe_fd;
+    uint64_t probe_deadline_ns;
+};
+
+struct group_point
+{
+    uint32_t hash;
+    int backend;
+};
+
+/**
+ * A backend group endpoint, GROUP<policy>[,probe]:<target>+<target>+..., where the policy is
+ * rr, lc or hash. Each session connects to one backend. The consistent hash ring places
+ * GROUP_VNODES points per backend, so removing a backend only moves the sessions it served.
+ */
+struct backend_group
+{
+    enum group_policy policy;
+    bool probe;
+    char flag;
+    struct backend backends[GROUP_MAX_BACKENDS];
+    int nbackends;
+    int next;
+    struct group_point ring[GROUP_MAX_BACKENDS * GROUP_VNODES];
+    int npoints;
+};
+
+// Set in a session whose client endpoint was already connected by the worker
+bool upstream_ready = false;
+
+uint32_t fnv1a(const void *data, size_t length, uint32_t hash = 2166136261u)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+int compare_group_points(const void *a, const void *b)
+{
+    uint32_t x = ((const struct group_point *)a)->hash;
+    uint32_t y = ((const struct group_point *)b)->hash;
+    return (x > y) - (x < y);
+}
+
+/**
+ * parse_backend_group: Parses a GROUP endpoint argument in place.
+ * @return 0 on success, -1 if the policy or one of the targets is invalid.
+ */
+int parse_backend_group(char *arg, struct backend_group *group)
+{
+    char *targets = strchr(arg, ':');
+    if (targets == NULL)
+        return -1;
+    *targets++ = '\0';
+    char *policy = arg + 5;
+    char *option = strchr(policy, ',');
+    group->probe = false;
+    if (option != NULL)
+    {
+        *option++ = '\0';
+        if (strcmp(option, "probe") != 0)
+            return -1;
+        group->probe = true;
+    }
+    if (strcmp(policy, "rr") == 0)
+        group->policy = GROUP_ROUND_ROBIN;
+    else if (strcmp(policy, "lc") == 0)
+        group->policy = GROUP_LEAST_CONNECTIONS;
+    else if (strcmp(policy, "hash") == 0)
+        group->policy = GROUP_CONSISTENT_HASH;
+    else
+        return -1;
+
+    group->nbackends = 0;
+    group->next = 0;
+    group->npoints = 0;
+    for (char *item = strtok(targets, "+"); item != NULL; item = strtok(NULL, "+"))
+    {
+        if (group->nbackends == GROUP_MAX_BACKENDS)
+            return -1;
+        struct backend *backend = &group->backends[group->nbackends];
+        memset(backend, 0, sizeof(*backend));
+        backend->name = strdup(item);
+        backend->probe_fd = -1;
+        if (parse_client_target(item, &backend->target) == -1)
+            return -1;
+        for (int i = 0; i < GROUP_VNODES; i++)
+        {
+            group->ring[group->npoints].hash = fnv1a(&i, sizeof(i), fnv1a(backend->name, strlen(backend->name)));
+            group->ring[group->npoints].backend = group->nbackends;
+            group->npoints++;
+        }
+        group->nbackends++;
+    }
+    qsort(group->ring, group->npoints, sizeof(group->ring[0]), compare_group_points);
+    return group->nbackends > 0 ? 0 : -1;
+}
+
+/**
+ * connect_backend_start: Starts a non-blocking connect to a backend without exiting on failure.
+ * @return The socket, connected or with the connect in progress, or -1 on failure.
+ */
+int connect_backend_start(const struct client_target *target)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int domain = AF_UNIX;
+    int type = SOCK_STREAM;
+    memset(&addr, 0, sizeof(addr));
+    if (target->kind == TARGET_TCP || target->kind == TARGET_UDP)
+    {
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(target->port);
+        if (resolve_ipv4(target->hostname, &in->sin_addr) == -1)
+            return -1;
+        addr_len = sizeof(*in);
+        domain = AF_INET;
+        if (target->kind == TARGET_UDP)
+            type = SOCK_DGRAM;
+    }
+    else
+    {
+        addr_len = fill_uds_address(target->path, (struct sockaddr_un *)&addr);
+        if (target->kind == TARGET_UDS_DATAGRAM)
+            type = SOCK_DGRAM;
+        else if (target->kind == TARGET_UDS_SEQPACKET)
+            type = SOCK_SEQPACKET;
+    }
+
+    int fd = socket(domain, type | SOCK_NONBLOCK, 0);
+    if (fd == -1)
+        return -1;
+    sa_family_t family = AF_UNIX;
+    // A UDS datagram client needs a name of its own, see start_uds_client_datagram()
+    if ((target->kind == TARGET_UDS_DATAGRAM && bind(fd, (struct sockaddr *)&family, sizeof(family)) == -1) ||
+        (connect(fd, (struct sockaddr *)&addr, addr_len) == -1 && errno != EINPROGRESS))
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * connect_error: The outcome of a non-blocking connect once its socket is writable.
+ * @return 0 if it connected, the error otherwise.
+ */
+int connect_error(int fd)
+{
+    int error;
+    socklen_t error_len = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1)
+        return errno;
+    return error;
+}
+
+/**
+ * connect_backend_finish: Completes a connect started by connect_backend_start() once its
+ *                         socket is writable, and puts the socket back in blocking mode.
+ * @return 0 on success, -1 with errno set on failure. The socket stays open either way.
+ */
+int connect_backend_finish(int fd, const struct client_target *target)
+{
+    int error = connect_error(fd);
+    if (error != 0)
+    {
+        errno = error;
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    if (target->kind == TARGET_UDS_DATAGRAM && send(fd, "", 0, 0) == -1)
+        return -1;
+    return 0;
+}
+
+/**
+ * connect_backend: Connects to a backend without exiting on failure. Connection-oriented
+ *                  targets are connected without blocking longer than timeout_ms.
+ * @return The connected socket in blocking mode, or -1 on failure.
+ */
+int connect_backend(const struct client_target *target, int timeout_ms)
+{
+    int fd = connect_backend_start(target);
+    if (fd == -1)
+        return -1;
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, timeout_ms) != 1)
+    {
+        close(fd);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (connect_backend_finish(fd, target) == -1)
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * group_session_key: The consistent hash key of a session, its client's address without the
+ *                    port so that all connections from one host reach the same backend.
+ */
+uint32_t group_session_key(int fd)
+{
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    if (fd == -1 || getpeername(fd, (struct sockaddr *)&peer, &peer_len) == -1)
+        return 0;
+    if (peer.ss_family == AF_INET)
+    {
+        const struct in_addr *addr = &((const struct sockaddr_in *)&peer)->sin_addr;
+        return fnv1a(addr, sizeof(*addr));
+    }
+    if (peer.ss_family == AF_INET6)
+    {
+        const struct in6_addr *addr = &((const struct sockaddr_in6 *)&peer)->sin6_addr;
+        return fnv1a(addr, sizeof(*addr));
+    }
+    return 0;
+}
+
+bool backend_available(const struct backend *backend, uint64_t now)
+{
+    return now >= backend->ejected_until_ns;
+}
+
+/**
+ * group_select: Picks the backend for a session among the backends that are not ejected.
+ * @return The backend index, or -1 if every backend is ejected.
+ */
+int group_select(struct backend_group *group, uint32_t key, uint64_t now)
+{
+    if (group->policy == GROUP_CONSISTENT_HASH)
+    {
+        // The first point clockwise from the key whose backend is available
+        int first = 0;
+        while (first < group->npoints && group->ring[first].hash < key)
+            first++;
+        for (int i = 0; i < group->npoints; i++)
+        {
+            int backend = group->ring[(first + i) % group->npoints].backend;
+            if (backend_available(&group->backends[backend], now))
+                return backend;
+        }
+        return -1;
+    }
+
+    int chosen = -1;
+    for (int i = 0; i < group->nbackends; i++)
+    {
+        int backend = (group->next + i) % group->nbackends;
+        if (!backend_available(&group->backends[backend], now))
+            continue;
+        if (chosen == -1 || group->backends[backend].active < group->backends[chosen].active)
+            chosen = backend;
+        if (group->policy == GROUP_ROUND_ROBIN)
+            break;
+    }
+    if (chosen != -1)
+        group->next = (chosen + 1) % group->nbackends;
+    return chosen;
+}
+
+void group_eject(struct backend_group *group, int index, uint64_t now)
+{
+    struct backend *backend = &group->backends[index];
+    if (backend_available(backend, now))
+        LOG_INFO("Backend %s ejected\n", backend->name);
+    backend->ejected_until_ns = now + GROUP_EJECT_NS;
+}
+
+/**
+ * group_connect: Connects a session to a backend. A backend that refuses the connection is
+ *                ejected at once and the next one is tried. This blocks for each backend,
+ *                it serves the single session of an instance without -w. A worker connects
+ *                its sessions from its poll loop instead, see worker_connect().
+ * @param key: The session key, see group_session_key().
+ * @param index: Receives the index of the backend.
+ * @return The connected socket, or -1 if no backend could be reached.
+ */
+int group_connect(struct backend_group *group, uint32_t key, int *index)
+{
+    uint64_t now = monotonic_ns();
+    while ((*index = group_select(group, key, now)) != -1)
+    {
+        struct backend *backend = &group->backends[*index];
+        int fd = connect_backend(&backend->target, GROUP_CONNECT_TIMEOUT_MS);
+        if (fd != -1)
+        {
+            if (backend->ejected_until_ns != 0)
+                LOG_INFO("Backend %s is back\n", backend->name);
+            backend->ejected_until_ns = 0;
+            LOG_DEBUG("Session connected to backend %s\n", backend->name);
+            return fd;
+        }
+        LOG_DEBUG("Backend %s failed: %s\n", backend->name, strerror(errno));
+        group_eject(group, *index, now);
+    }
+    fprintf(stderr, "No backend available\n");
+    return -1;
+}
+
+#define MAX_WORKERS 64
+#define MAX_PENDING 1024
+#define MAX_PASSED_FDS 16
+
+/**
+ * Message sent by the acceptor together with a connected client fd.
+ * flag is the -i/-o/-b flag of the acceptor's server endpoint, it tells the worker
+ * whether the fd becomes its input, its output or both.
+ */
+struct handoff_msg
+{
+    char flag;
+};
+
+/**
+ * Message sent by a worker to the acceptor whenever its load changes.
+ * received counts the handoffs the worker has taken so far, which lets the acceptor
+ * add the connections still in flight to the reported number of active sessions.
+ */
+struct worker_report
+{
+    unsigned int active;
+    unsigned int received;
+    unsigned int completed;
+};
+
+struct worker_slot
+{
+    int fd;
+    unsigned int sent;
+    struct worker_report report;
+};
+
+int worker_sigchld_pipe[2] = {-1, -1};
+
+/**
+ * send_fds: Sends a message with file descriptors attached as SCM_RIGHTS ancillary data.
+ * @param sock: A connected Unix domain socket.
+ * @param fds: The file descriptors to pass, at most MAX_PASSED_FDS.
+ * @param nfds: The number of file descriptors.
+ * @param data: The message sent along with the descriptors, it must not be empty.
+ * @param len: The length of the message.
+ * @return 0 on success, -1 on failure.
+ */
+int send_fds(int sock, const int *fds, int nfds, const void *data, size_t len)
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<void *>(data);
+    iov.iov_len = len;
+
+    char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds > 0)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+/**
+ * recv_fds: Receives a message and the file descriptors attached to it as SCM_RIGHTS.
+ *           The received descriptors are close-on-exec.
+ * @param sock: A connected Unix domain socket.
+ * @param fds: Array receiving the descriptors.
+ * @param nfds: In: the size of fds. Out: the number of descriptors received.
+ * @param data: Buffer receiving the message.
+ * @param len: The size of the buffer.
+ * @return The length of the message, 0 if the peer closed the socket, or -1 on failure.
+ */
+ssize_t recv_fds(int sock, int *fds, int *nfds, void *data, size_t len)
+{
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = len;
+
+    char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t bytes = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    int count = 0;
+    if (bytes > 0)
+    {
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            {
+                continue;
+            }
+            int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *passed = (int *)CMSG_DATA(cmsg);
+            for (int i = 0; i < n; i++)
+            {
+                // Descriptors that do not fit are closed so they do not leak
+                if (count < *nfds)
+                    fds[count++] = passed[i];
+                else
+                    close(passed[i]);
+            }
+        }
+    }
+    *nfds = count;
+    return bytes;
+}
+
+/**
+ * worker_load: The load of a worker as seen by the acceptor.
+ *              It is the number of sessions the worker reported as active plus the
+ *              connections that were sent but not yet acknowledged in a report.
+ */
+unsigned int worker_load(const struct worker_slot *worker)
+{
+    return worker->report.active + (worker->sent - worker->report.received);
+}
+
+/**
+ * The sockets an acceptor owns, and that a hot restart hands to the next instance:
+ * the client listener, the worker control listener, the hot restart listener (or -1)
+ * and the accepted connections that no worker has taken yet.
+ */
+struct acceptor_sockets
+{
+    int listen_fd;
+    int ctl_fd;
+    int restart_fd;
+    int pending[MAX_PENDING];
+    int npending;
+};
+
+/**
+ * Header of the hot restart messages. The first message carries the three listeners,
+ * the following ones carry queued connections, and a message without fds ends the handoff.
+ */
+struct restart_handoff
+{
+    int listeners;
+    int pending;
+};
+
+/**
+ * hot_restart_takeover: Asks a running instance listening on the hot restart socket for its
+ *                       sockets. The listeners keep their bound address and accept queue, so
+ *                       nothing is unbound, unlinked or refused during the upgrade.
+ * @param path: The hot restart socket path, or "@name" for an abstract address.
+ * @param sockets: Receives the sockets of the running instance.
+ * @return 0 if the sockets were taken over, -1 if no instance is running.
+ */
+int hot_restart_takeover(const char *path, struct acceptor_sockets *sockets)
+{
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    socklen_t addr_len = fill_uds_address(path, &addr);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, addr_len) == -1 || send(sock, "T", 1, MSG_NOSIGNAL) != 1)
+    {
+        if (sock != -1)
+            close(sock);
+        return -1;
+    }
+
+    sockets->npending = 0;
+    bool have_listeners = false;
+    while (true)
+    {
+        struct restart_handoff handoff;
+        int fds[MAX_PASSED_FDS];
+        int nfds = MAX_PASSED_FDS;
+        ssize_t bytes = recv_fds(sock, fds, &nfds, &handoff, sizeof(handoff));
+        if (bytes == -1 && errno == EINTR)
+            continue;
+        if (bytes != (ssize_t)sizeof(handoff) || nfds != handoff.listeners + handoff.pending)
+        {
+            fprintf(stderr, "Hot restart handoff from %s failed\n", path);
+            closeResourcesAndExit(EXIT_FAILURE);
+        }
+        if (nfds == 0)
+            break;
+        int first = 0;
+        if (handoff.listeners == 3)
+        {
+            sockets->listen_fd = fds[0];
+            sockets->ctl_fd = fds[1];
+            sockets->restart_fd = fds[2];
+            have_listeners = true;
+            first = 3;
+        }
+        for (int i = first; i < nfds; i++)
+        {
+            if (sockets->npending < MAX_PENDING)
+                sockets->pending[sockets->npending++] = fds[i];
+            else
+                close(fds[i]);
+        }
+    }
+    close(sock);
+    if (!have_listeners)
+    {
+        fprintf(stderr, "Hot restart handoff from %s had no listeners\n", path);
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    LOG_INFO("Took over the listeners and %d queued connections from %s\n", sockets->npending, path);
+    return 0;
+}
+
+/**
+ * hot_restart_handoff: Sends this acceptor's listeners and queued connections to a new instance
+ *                      that connected to the hot restart socket.
+ * @return 0 on success, -1 if the new instance went away, in which case this one keeps serving.
+ */
+int hot_restart_handoff(int sock, const struct acceptor_sockets *sockets)
+{
+    struct restart_handoff handoff;
+    handoff.listeners = 3;
+    handoff.pending = 0;
+    int listeners[3] = {sockets->listen_fd, sockets->ctl_fd, sockets->restart_fd};
+    if (send_fds(sock, listeners, 3, &handoff, sizeof(handoff)) == -1)
+        return -1;
+
+    handoff.listeners = 0;
+    for (int sent = 0; sent < sockets->npending; sent += handoff.pending)
+    {
+        handoff.pending = sockets->npending - sent;
+        if (handoff.pending > MAX_PASSED_FDS)
+            handoff.pending = MAX_PASSED_FDS;
+        if (send_fds(sock, &sockets->pending[sent], handoff.pending, &handoff, sizeof(handoff)) == -1)
+            return -1;
+    }
+    handoff.pending = 0;
+    return send_fds(sock, NULL, 0, &handoff, sizeof(handoff));
+}
+
+/**
+ * run_acceptor: Accepts clients on a listening socket and hands every connected fd to the least
+ *               loaded worker over a SOCK_SEQPACKET control socket with SCM_RIGHTS.
+ *               Workers (mync -w) register by connecting to the control socket and report their
+ *               load back. Connections that arrive while no worker is registered wait in a queue.
+ *               When a new instance connects to the hot restart socket, all sockets are handed
+ *               to it and this instance exits. This function never returns.
+ * @param sockets: The listeners, and the connections queued by a previous instance.
+ * @param flag: The -i/-o/-b flag of the server endpoint, forwarded to the workers.
+ */
+void run_acceptor(struct acceptor_sockets *sockets, char flag)
+{
+    int listen_fd = sockets->listen_fd;
+    int ctl_fd = sockets->ctl_fd;
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+    LOG_INFO("Acceptor waiting for workers\n");
+
+    struct worker_slot workers[MAX_WORKERS];
+    int nworkers = 0;
+    int *pending = sockets->pending;
+    int &npending = sockets->npending;
+    int next_worker = 0;
+    struct handoff_msg handoff;
+    handoff.flag = flag;
+
+    while (true)
+    {
+        struct pollfd pfds[3 + MAX_WORKERS];
+        // Stop accepting while the queue is full so the kernel backlog pushes back on clients
+        pfds[0].fd = listen_fd;
+        pfds[0].events = (npending < MAX_PENDING) ? POLLIN : 0;
+        pfds[1].fd = ctl_fd;
+        pfds[1].events = POLLIN;
+        pfds[2].fd = sockets->restart_fd;
+        pfds[2].events = POLLIN;
+        for (int i = 0; i < nworkers; i++)
+        {
+            pfds[3 + i].fd = workers[i].fd;
+            pfds[3 + i].events = POLLIN;
+        }
+
+        if (poll(pfds, 3 + nworkers, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            closeResourcesAndExit(EXIT_FAILURE);
+        }
+
+        if (pfds[2].revents & POLLIN)
+        {
+            int sock = accept4(sockets->restart_fd, NULL, NULL, SOCK_CLOEXEC);
+            char request;
+            if (sock != -1 && recv(sock, &request, 1, 0) == 1 && hot_restart_handoff(sock, sockets) == 0)
+            {
+                // The workers see their control connection close and register with the new instance
+                LOG_INFO("Handed the listeners and %d queued connections to a new instance, exiting\n", npending);
+                exit(EXIT_SUCCESS);
+            }
+            if (sock != -1)
+                close(sock);
+        }
+
+        // Collect the reports first, removing a worker moves the last one into its slot
+        for (int i = nworkers - 1; i >= 0; i--)
+        {
+            if (pfds[3 + i].revents == 0)
+                continue;
+            struct worker_report report;
+            ssize_t bytes = recv(workers[i].fd, &report, sizeof(report), 0);
+            if (bytes == (ssize_t)sizeof(report))
+            {
+                workers[i].report = report;
+                continue;
+            }
+            if (bytes == -1 && errno == EINTR)
+                continue;
+            LOG_INFO("Worker %d left after %u sessions\n", workers[i].fd, workers[i].report.completed);
+            close(workers[i].fd);
+            workers[i] = workers[--nworkers];
+        }
+
+        if (pfds[1].revents & POLLIN)
+        {
+            int fd = accept4(ctl_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd != -1 && nworkers < MAX_WORKERS)
+            {
+                memset(&workers[nworkers], 0, sizeof(workers[nworkers]));
+                workers[nworkers++].fd = fd;
+                LOG_INFO("Worker %d registered\n", fd);
+            }
+            else if (fd != -1)
+            {
+                fprintf(stderr, "Too many workers\n");
+                close(fd);
+            }
+        }
+
+        if (pfds[0].revents & POLLIN)
+        {
+            while (npending < MAX_PENDING)
+            {
+                int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                if (fd == -1)
+                    break;
+                pending[npending++] = fd;
+            }
+        }
+
+        // Hand the queued connections out, oldest first
+        int handed = 0;
+        while (handed < npending && nworkers > 0)
+        {
+            // Scan from a rotating start so equally loaded workers take turns
+            int best = -1;
+            for (int n = 0; n < nworkers; n++)
+            {
+                int i = (next_worker + n) % nworkers;
+                if (best == -1 || worker_load(&workers[i]) < worker_load(&workers[best]))
+                    best = i;
+            }
+            next_worker = (best + 1) % nworkers;
+
+            if (send_fds(workers[best].fd, &pending[handed], 1, &handoff, sizeof(handoff)) == -1)
+            {
+                perror("Failed to hand off connection");
+                close(workers[best].fd);
+                workers[best] = workers[--nworkers];
+                continue;
+            }
+            workers[best].sent++;
+            close(pending[handed++]);
+        }
+        memmove(pending, pending + handed, (npending - handed) * sizeof(int));
+        npending -= handed;
+    }
+}
+
+void worker_sigchld(int)
+{
+    int saved_errno = errno;
+    ssize_t ignored = write(worker_sigchld_pipe[1], "c", 1);
+    (void)ignored;
+    errno = saved_errno;
+}
+
+/**
+ * connect_acceptor: Connects a worker to the control socket of an acceptor.
+ * @return The connected socket, or -1 on failure.
+ */
+int connect_acceptor(const char *ctlpath)
+{
+    int ctl_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (ctl_fd == -1)
+        return -1;
+    struct sockaddr_un addr;
+    socklen_t addr_len = fill_uds_address(ctlpath, &addr);
+    if (connect(ctl_fd, (struct sockaddr *)&addr, addr_len) == -1)
+    {
+        close(ctl_fd);
+        return -1;
+    }
+    return ctl_fd;
+}
+
+/**
+ * A session received from the acceptor that waits for a pooled upstream connection.
+ */
+struct waiting_session
+{
+    int fd;
+    char flag;
+};
+
+/**
+ * A session received from the acceptor whose connect to a backend is in progress.
+ */
+struct connecting_session
+{
+    int fd;
+    char flag;
+    uint32_t key;
+    int backend;
+    int upstream_fd;
+    uint64_t deadline_ns;
+};
+
+/**
+ * The worker's bookkeeping: its load report, with a pool the upstream connection lent to
+ * each running session and the sessions that wait for one, and with a backend group the
+ * sessions that connect to a backend and the backend of each running session.
+ */
+struct worker_state
+{
+    int ctl_fd;
+    struct worker_report report;
+    struct upstream_pool *pool;
+    std::unordered_map<pid_t, int> upstreams;
+    struct waiting_session waiting[MAX_PENDING];
+    int nwaiting;
+    struct backend_group *group;
+    struct connecting_session connecting[MAX_PENDING];
+    int nconnecting;
+    std::unordered_map<pid_t, int> backends;
+};
+
+/**
+ * worker_start_session: Forks the child that serves a session. The child drops the worker's
+ *                       plumbing and the fds of the other sessions, and gets input_fd/output_fd
+ *                       set from the acceptor's flag and, with a pool or a group, the upstream's flag.
+ * @param upstream_fd: The connection lent by the pool or opened to a backend, or -1.
+ * @param backend: The index of the backend in the group, or -1.
+ * @return 0 in the child, the child's pid in the worker, or -1 if fork failed.
+ */
+pid_t worker_start_session(struct worker_state *state, int fd, char flag, int upstream_fd, int backend)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        signal(SIGCHLD, SIG_DFL);
+        close(state->ctl_fd);
+        close(worker_sigchld_pipe[0]);
+        close(worker_sigchld_pipe[1]);
+        if (flag == 'i' || flag == 'b')
+            input_fd = fd;
+        if (flag == 'o' || flag == 'b')
+            output_fd = fd;
+        if (state->pool != NULL)
+        {
+            for (unsigned int i = 0; i < state->pool->nidle; i++)
+                close(state->pool->idle[i]);
+            for (auto &entry : state->upstreams)
+                close(entry.second);
+            for (int i = 0; i < state->nwaiting; i++)
+                close(state->waiting[i].fd);
+            // Zero-copy completions are numbered per socket, a reused connection would confuse them
+            zerocopy_threshold = 0;
+        }
+        if (state->group != NULL)
+        {
+            for (int i = 0; i < state->nconnecting; i++)
+            {
+                close(state->connecting[i].fd);
+                close(state->connecting[i].upstream_fd);
+            }
+            for (int i = 0; i < state->group->nbackends; i++)
+                if (state->group->backends[i].probe_fd != -1)
+                    close(state->group->backends[i].probe_fd);
+        }
+        if (upstream_fd != -1)
+        {
+            char upstream_flag = state->pool != NULL ? state->pool->flag : state->group->flag;
+            if (upstream_flag == 'i' || upstream_flag == 'b')
+                input_fd = upstream_fd;
+            if (upstream_flag == 'o' || upstream_flag == 'b')
+                output_fd = upstream_fd;
+            upstream_ready = true;
+        }
+        return 0;
+    }
+    if (pid == -1)
+        perror("fork");
+    else
+        state->report.active++;
+    if (state->pool != NULL && upstream_fd != -1)
+    {
+        if (pid == -1)
+            pool_return(state->pool, upstream_fd);
+        else
+            state->upstreams[pid] = upstream_fd;
+    }
+    else if (upstream_fd != -1)
+    {
+        close(upstream_fd);
+        if (pid != -1)
+        {
+            state->backends[pid] = backend;
+            state->group->backends[backend].active++;
+        }
+    }
+    close(fd);
+    return pid;
+}
+
+/**
+ * worker_connect: Starts the connect of a session to a backend without blocking, the worker's
+ *                 poll loop completes it in worker_connected(). A backend that refuses at once
+ *                 is ejected and the next one is tried.
+ * @param session: Its backend is set to -1 if no backend could be tried.
+ */
+void worker_connect(struct worker_state *state, struct connecting_session *session)
+{
+    uint64_t now = monotonic_ns();
+    while ((session->backend = group_select(state->group, session->key, now)) != -1)
+    {
+        struct backend *backend = &state->group->backends[session->backend];
+        session->upstream_fd = connect_backend_start(&backend->target);
+        if (session->upstream_fd != -1)
+        {
+            session->deadline_ns = now + GROUP_CONNECT_TIMEOUT_MS * 1000000ull;
+            return;
+        }
+        LOG_DEBUG("Backend %s failed: %s\n", backend->name, strerror(errno));
+        group_eject(state->group, session->backend, now);
+    }
+}
+
+/**
+ * worker_connected: Goes on with a connecting session after a poll. The session starts once
+ *                   its connect completed. A connect that failed or timed out ejects the
+ *                   backend and the next one is tried, a session with no backend left is closed.
+ * @param revents: The poll result of the session's upstream socket.
+ * @return 0 in the child, 1 in the worker.
+ */
+int worker_connected(struct worker_state *state, int index, short revents, uint64_t now)
+{
+    struct connecting_session *session = &state->connecting[index];
+    if (revents == 0 && now < session->deadline_ns)
+        return 1;
+    struct backend *backend = &state->group->backends[session->backend];
+    if (revents != 0 && connect_backend_finish(session->upstream_fd, &backend->target) == 0)
+    {
+        if (backend->ejected_until_ns != 0)
+            LOG_INFO("Backend %s is back\n", backend->name);
+        backend->ejected_until_ns = 0;
+        LOG_DEBUG("Session connected to backend %s\n", backend->name);
+        struct connecting_session started = *session;
+        *session = state->connecting[--state->nconnecting];
+        state->report.active--;
+        return worker_start_session(state, started.fd, started.flag, started.upstream_fd, started.backend) == 0 ? 0 : 1;
+    }
+    LOG_DEBUG("Backend %s failed: %s\n", backend->name, strerror(revents != 0 ? errno : ETIMEDOUT));
+    close(session->upstream_fd);
+    group_eject(state->group, session->backend, now);
+    worker_connect(state, session);
+    if (session->backend != -1)
+        return 1;
+    fprintf(stderr, "No backend available\n");
+    close(session->fd);
+    *session = state->connecting[--state->nconnecting];
+    state->report.active--;
+    return 1;
+}
+
+/**
+ * group_start_probes: Starts a probe connect to each ejected backend that has none running.
+ *                     A probe is only a connect, it is closed as soon as it completes, so it is
+ *                     an empty session for a backend that serves a single connection, which is
+ *                     why probes are only run for a GROUP with the probe option.
+ */
+void group_start_probes(struct backend_group *group, uint64_t now)
+{
+    for (int i = 0; i < group->nbackends; i++)
+    {
+        struct backend *backend = &group->backends[i];
+        if (backend_available(backend, now) || backend->probe_fd != -1)
+            continue;
+        backend->probe_fd = connect_backend_start(&backend->target);
+        if (backend->probe_fd == -1)
+            group_eject(group, i, now);
+        else
+            backend->probe_deadline_ns = now + GROUP_CONNECT_TIMEOUT_MS * 1000000ull;
+    }
+}
+
+/**
+ * group_probe_done: Ends the probe of a backend after a poll once it connected, failed or
+ *                   timed out. A probe that connected readmits the backend, the others
+ *                   extend its ejection.
+ * @param revents: The poll result of the probe socket.
+ */
+void group_probe_done(struct backend_group *group, int index, short revents, uint64_t now)
+{
+    struct backend *backend = &group->backends[index];
+    if (backend->probe_fd == -1 || (revents == 0 && now < backend->probe_deadline_ns))
+        return;
+    if (revents != 0 && connect_error(backend->probe_fd) == 0)
+    {
+        if (!backend_available(backend, now))
+            LOG_INFO("Backend %s is back\n", backend->name);
+        backend->ejected_until_ns = 0;
+    }
+    else
+        group_eject(group, index, now);
+    close(backend->probe_fd);
+    backend->probe_fd = -1;
+}
+
+/**
+ * worker_group_deadline: The earliest time the worker must wake up for its backend group: a
+ *                        connect or probe that times out, or the next round of probes.
+ * @return The deadline, or UINT64_MAX if there is none.
+ */
+uint64_t worker_group_deadline(const struct worker_state *state, uint64_t probed_ns)
+{
+    const struct backend_group *group = state->group;
+    uint64_t deadline = group->probe ? probed_ns + GROUP_PROBE_INTERVAL_NS : UINT64_MAX;
+    for (int i = 0; i < state->nconnecting; i++)
+        deadline = std::min(deadline, state->connecting[i].deadline_ns);
+    for (int i = 0; i < group->nbackends; i++)
+        if (group->backends[i].probe_fd != -1)
+            deadline = std::min(deadline, group->backends[i].probe_deadline_ns);
+    return deadline;
+}
+
+/**
+ * worker_dispatch: Starts a session, or queues it while the pool has no connection to lend or
+ *                  while its backend connect is in progress. A session whose upstream cannot
+ *                  be reached is closed.
+ * @return 0 in the child, 1 in the worker.
+ */
+int worker_dispatch(struct worker_state *state, int fd, char flag)
+{
+    if (state->group != NULL)
+    {
+        if (state->nconnecting == MAX_PENDING)
+        {
+            fprintf(stderr, "Too many sessions connecting to backends\n");
+            close(fd);
+            return 1;
+        }
+        struct connecting_session *session = &state->connecting[state->nconnecting];
+        session->fd = fd;
+        session->flag = flag;
+        session->key = group_session_key(fd);
+        worker_connect(state, session);
+        if (session->backend == -1)
+        {
+            fprintf(stderr, "No backend available\n");
+            close(fd);
+            return 1;
+        }
+        state->nconnecting++;
+        state->report.active++;
+        return 1;
+    }
+    if (state->pool == NULL)
+        return worker_start_session(state, fd, flag, -1, -1) == 0 ? 0 : 1;
+    if (pool_exhausted(state->pool) && state->nwaiting < MAX_PENDING)
+    {
+        LOG_DEBUG("Upstream pool exhausted, session %d waits\n", fd);
+        state->waiting[state->nwaiting].fd = fd;
+        state->waiting[state->nwaiting].flag = flag;
+        state->nwaiting++;
+        state->report.active++;
+        return 1;
+    }
+    int upstream_fd = pool_borrow(state->pool);
+    if (upstream_fd == -1)
+    {
+        close(fd);
+        return 1;
+    }
+    return worker_start_session(state, fd, flag, upstream_fd, -1) == 0 ? 0 : 1;
+}
+
+/**
+ * run_worker: Registers with an acceptor (mync -a) and serves the connections it hands over.
+ *             Every received fd is served by a forked child. The child returns from this function
+ *             with input_fd/output_fd set, so main() goes on to run the session as usual.
+ *             The parent reports its load whenever a session starts or ends. When the acceptor
+ *             goes away the worker registers again, which reaches the new instance after a
+ *             hot restart. If that fails it waits for the running sessions and exits.
+ * @param ctlpath: The control socket path of the acceptor, or "@name" for an abstract address.
+ * @param pool: The upstream connection pool that lends each session its client connection, or NULL.
+ * @param group: The backend group that each session connects to, or NULL.
+ */
+void run_worker(const char *ctlpath, struct upstream_pool *pool, struct backend_group *group)
+{
+    static struct worker_state state;
+    state.pool = pool;
+    state.group = group;
+    state.ctl_fd = connect_acceptor(ctlpath);
+    if (state.ctl_fd == -1)
+    {
+        perror("error connecting to acceptor");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    LOG_INFO("Worker registered with acceptor %s\n", ctlpath);
+
+    if (pipe2(worker_sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1)
+    {
+        perror("pipe");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = worker_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    struct worker_report &report = state.report;
+    bool acceptor_alive = true;
+    bool changed = false;
+    uint64_t maintained_ns = 0;
+    uint64_t probed_ns = 0;
+
+    while (acceptor_alive || report.active > 0)
+    {
+        if (pool != NULL && monotonic_ns() - maintained_ns >= POOL_MAINTAIN_INTERVAL_NS)
+        {
+            pool_maintain(pool);
+            maintained_ns = monotonic_ns();
+        }
+        if (group != NULL && group->probe && monotonic_ns() - probed_ns >= GROUP_PROBE_INTERVAL_NS)
+        {
+            probed_ns = monotonic_ns();
+            group_start_probes(group, probed_ns);
+        }
+
+        // The sigchld pipe, the acceptor, then with a group the connecting sessions and the probes
+        static struct pollfd pfds[2 + MAX_PENDING + GROUP_MAX_BACKENDS];
+        pfds[0].fd = worker_sigchld_pipe[0];
+        pfds[0].events = POLLIN;
+        pfds[1].fd = acceptor_alive ? state.ctl_fd : -1;
+        pfds[1].events = POLLIN;
+        int npfds = 2;
+        int nconnecting = state.nconnecting;
+        int timeout = (pool != NULL) ? POOL_MAINTAIN_INTERVAL_NS / 1000000 : -1;
+        if (group != NULL)
+        {
+            for (int i = 0; i < nconnecting; i++)
+            {
+                pfds[npfds].fd = state.connecting[i].upstream_fd;
+                pfds[npfds++].events = POLLOUT;
+            }
+            for (int i = 0; i < group->nbackends; i++)
+            {
+                pfds[npfds].fd = group->backends[i].probe_fd;
+                pfds[npfds++].events = POLLOUT;
+            }
+            uint64_t now = monotonic_ns();
+            uint64_t deadline = worker_group_deadline(&state, probed_ns);
+            if (deadline != UINT64_MAX)
+                timeout = deadline > now ? (deadline - now + 999999) / 1000000 : 0;
+        }
+        if (poll(pfds, npfds, timeout) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            closeResourcesAndExit(EXIT_FAILURE);
+        }
+
+        if (group != NULL)
+        {
+            uint64_t now = monotonic_ns();
+            for (int i = 0; i < group->nbackends; i++)
+                group_probe_done(group, i, pfds[2 + nconnecting + i].revents, now);
+            // Backwards, a finished session is replaced by the last one, which was already handled
+            for (int i = nconnecting - 1; i >= 0; i--)
+                if (worker_connected(&state, i, pfds[2 + i].revents, now) == 0)
+                    return;
+            if (state.nconnecting != nconnecting)
+                changed = true;
+        }
+
+        if (pfds[0].revents & POLLIN)
+        {
+            char drain[64];
+            while (read(worker_sigchld_pipe[0], drain, sizeof(drain)) > 0)
+                ;
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+            {
+                report.active--;
+                report.completed++;
+                changed = true;
+                auto upstream = state.upstreams.find(pid);
+                if (upstream != state.upstreams.end())
+                {
+                    pool_return(pool, upstream->second);
+                    state.upstreams.erase(upstream);
+                }
+                auto backend = state.backends.find(pid);
+                if (backend != state.backends.end())
+                {
+                    group->backends[backend->second].active--;
+                    state.backends.erase(backend);
+                }
+            }
+            // Returned connections go to the sessions that wait for one
+            while (state.nwaiting > 0 && !pool_exhausted(pool))
+            {
+                struct waiting_session session = state.waiting[0];
+                state.nwaiting--;
+                memmove(state.waiting, state.waiting + 1, state.nwaiting * sizeof(state.waiting[0]));
+                report.active--;
+                if (worker_dispatch(&state, session.fd, session.flag) == 0)
+                    return;
+            }
+        }
+
+        if (pfds[1].revents)
+        {
+            struct handoff_msg handoff;
+            int fd;
+            int nfds = 1;
+            ssize_t bytes = recv_fds(state.ctl_fd, &fd, &nfds, &handoff, sizeof(handoff));
+            if (bytes <= 0 && !(bytes == -1 && errno == EINTR))
+            {
+                close(state.ctl_fd);
+                state.ctl_fd = connect_acceptor(ctlpath);
+                if (state.ctl_fd != -1)
+                {
+                    // A new acceptor counts the handoffs from zero
+                    LOG_INFO("Worker registered again with acceptor %s\n", ctlpath);
+                    report.received = 0;
+                    changed = true;
+                }
+                else
+                {
+                    LOG_INFO("Acceptor closed, draining %u sessions\n", report.active);
+                    acceptor_alive = false;
+                }
+            }
+            else if (nfds == 1)
+            {
+                report.received++;
+                changed = true;
+                // The session: let main() run it
+                if (worker_dispatch(&state, fd, handoff.flag) == 0)
+                    return;
+            }
+        }
+
+        if (changed && acceptor_alive && send(state.ctl_fd, &report, sizeof(report), MSG_NOSIGNAL) == -1)
+        {
+            perror("Failed to report load");
+        }
+        changed = false;
+    }
+    exit(EXIT_SUCCESS);
+}
+
+#define SHM_MAGIC 0x4d594e43u
+
+/**
+ * The message of the shared-memory handshake. The server sends it with the memfd and the four
+ * eventfds attached: the data and space eventfds of ring 0, then those of ring 1.
+ */
+struct shm_hello
+{
+    uint32_t magic;
+    uint32_t rings;
+    uint64_t capacity;
+};
+
+/**
+ * shm_attach: Maps the two rings of a shared-memory endpoint and sets up the global endpoint.
+ * @param sock: The handshake socket.
+ * @param memfd: The memory file holding the rings.
+ * @param eventfds: The data and space eventfds of ring 0, then those of ring 1.
+ * @param rx: The index of the ring this side reads, the other one is written.
+ * @return 0 on success, -1 on failure.
+ */
+int shm_attach(int sock, int memfd, const int *eventfds, int rx)
+{
+    size_t ring_size = SHM_RING_HEADER + SHM_RING_CAPACITY;
+    char *memory = (char *)mmap(NULL, 2 * ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (memory == MAP_FAILED)
+    {
+        perror("error mapping shared memory");
+        return -1;
+    }
+    close(memfd);
+
+    shm = (struct shm_endpoint *)calloc(1, sizeof(struct shm_endpoint));
+    if (shm == NULL)
+    {
+        perror("error allocating shared memory endpoint");
+        return -1;
+    }
+    shm->sock = sock;
+    struct shm_channel *channels[2] = {&shm->rx, &shm->tx};
+    for (int i = 0; i < 2; i++)
+    {
+        int ring = i == 0 ? rx : 1 - rx;
+        channels[i]->ring = (struct shm_ring *)(memory + ring * ring_size);
+        channels[i]->data = memory + ring * ring_size + SHM_RING_HEADER;
+        channels[i]->data_fd = eventfds[2 * ring];
+        channels[i]->space_fd = eventfds[2 * ring + 1];
+        channels[i]->spin_ns = SHM_SPIN_MIN_NS;
+    }
+    return 0;
+}
+
+/**
+ * shm_start_server: Listens on a UDS path, accepts one client and hands it the shared rings.
+ *                   The server reads ring 0 and writes ring 1.
+ * @param path: The socket path, or "@name" for an abstract address.
+ * @return The handshake socket, which stands in for the endpoint.
+ */
+int shm_start_server(char *path)
+{
+    int client_fd = start_uds_server_connected(path, SOCK_STREAM);
+
+    size_t ring_size = SHM_RING_HEADER + SHM_RING_CAPACITY;
+    int fds[5];
+    fds[0] = memfd_create("mync-shm", MFD_CLOEXEC);
+    if (fds[0] == -1 || ftruncate(fds[0], 2 * ring_size) == -1)
+    {
+        perror("error creating shared memory");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    for (int i = 1; i < 5; i++)
+    {
+        fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fds[i] == -1)
+        {
+            perror("error creating eventfd");
+            closeResourcesAndExit(EXIT_FAILURE);
+        }
+    }
+
+    // A fresh memfd is zero filled, only the capacities need to be set
+    char *memory = (char *)mmap(NULL, 2 * ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (memory == MAP_FAILED)
+    {
+        perror("error mapping shared memory");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    for (int ring = 0; ring < 2; ring++)
+        ((struct shm_ring *)(memory + ring * ring_size))->capacity = SHM_RING_CAPACITY;
+    munmap(memory, 2 * ring_size);
+
+    struct shm_hello hello = {SHM_MAGIC, 2, SHM_RING_CAPACITY};
+    if (send_fds(client_fd, fds, 5, &hello, sizeof(hello)) == -1)
+    {
+        perror("error sending shared memory");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    if (shm_attach(client_fd, fds[0], fds + 1, 0) == -1)
+        closeResourcesAndExit(EXIT_FAILURE);
+    LOG_INFO("Shared memory rings of %d bytes set up\n", SHM_RING_CAPACITY);
+    return client_fd;
+}
+
+/**
+ * shm_start_client: Connects to a shared-memory server and maps the rings it hands over.
+ *                   The client reads ring 1 and writes ring 0.
+ * @param path: The socket path, or "@name" for an abstract address.
+ * @return The handshake socket, which stands in for the endpoint.
+ */
+int shm_start_client(char *path)
+{
+    int sockfd = start_uds_client_connected(path, SOCK_STREAM);
+
+    int fds[5];
+    int nfds = 5;
+    struct shm_hello hello;
+    ssize_t bytes = recv_fds(sockfd, fds, &nfds, &hello, sizeof(hello));
+    if (bytes != sizeof(hello) || nfds != 5 || hello.magic != SHM_MAGIC || hello.rings != 2 ||
+        hello.capacity != SHM_RING_CAPACITY)
+    {
+        fprintf(stderr, "Invalid shared memory handshake\n");
+        for (int i = 0; i < nfds; i++)
+            close(fds[i]);
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    if (shm_attach(sockfd, fds[0], fds + 1, 1) == -1)
+        closeResourcesAndExit(EXIT_FAILURE);
+    LOG_INFO("Shared memory rings of %d bytes mapped\n", SHM_RING_CAPACITY);
+    return sockfd;
+}
+
+#define UDP_MAX_EVENTS 64
+
+/**
+ * A UDP peer and the session that serves it: a child process connected through a
+ * SOCK_SEQPACKET socketpair, which keeps the datagram boundaries in both directions, or the
+ * in-process echo handler when fd is -1. pid is 0 once the child was reaped.
+ */
+struct udp_session
+{
+    struct sockaddr_in peer;
+    int fd;
+    pid_t pid;
+    uint64_t last_active_ns;
+    bool ended;
+};
+
+uint64_t udp_peer_key(const struct sockaddr_in *peer)
+{
+    return ((uint64_t)ntohl(peer->sin_addr.s_addr) << 16) | ntohs(peer->sin_port);
+}
+
+/**
+ * udp_end_session: Ends a session and removes it from the tables. The session itself is only
+ *                  marked as ended, events already returned by epoll may still point to it,
+ *                  so it is freed after the current batch of events.
+ * @param children: The commands that were not reaped yet, only those are signalled.
+ */
+void udp_end_session(std::unordered_map<uint64_t, struct udp_session *> &sessions, std::unordered_map<pid_t, struct udp_session *> &children,
+                     std::vector<struct udp_session *> &ended, struct udp_session *session)
+{
+    if (session->fd != -1)
+        close(session->fd);
+    if (session->pid > 0)
+    {
+        kill(session->pid, SIGTERM);
+        children.erase(session->pid);
+    }
+    session->ended = true;
+    sessions.erase(udp_peer_key(&session->peer));
+    ended.push_back(session);
+}
+
+/**
+ * udp_start_session: Creates the session of a new peer. With a command, the command runs with
+ *                    its stdin and stdout on one end of a socketpair, the other end is watched
+ *                    by epoll so its output can be sent back to the peer.
+ * @return The session, or NULL if the child could not be started.
+ */
+struct udp_session *udp_start_session(int epoll_fd, const struct sockaddr_in *peer, const char *command)
+{
+    struct udp_session *session = new udp_session;
+    session->peer = *peer;
+    session->fd = -1;
+    session->pid = 0;
+    session->last_active_ns = monotonic_ns();
+    session->ended = false;
+    if (command == NULL)
+        return session;
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1)
+    {
+        perror("socketpair");
+        delete session;
+        return NULL;
+    }
+    int parent_fds[] = {pair[0], -1};
+    spawn_command(command, pair[1], pair[1], parent_fds);
+    session->pid = child;
+    child = 0;
+    close(pair[1]);
+    session->fd = pair[0];
+    fcntl(session->fd, F_SETFL, fcntl(session->fd, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = session;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, session->fd, &event);
+    return session;
+}
+
+/**
+ * run_udp_sessions: Serves many UDP peers on one port, with one session per peer address.
+ *                   Datagrams of a peer go to its session and the session's output is sent
+ *                   back to that peer. Sessions that are idle for idle_seconds are ended, as
+ *                   are sessions whose command exits. This function never returns.
+ * @param port: The UDP port to serve.
+ * @param command: The command run for each peer, or NULL to echo the datagrams back.
+ * @param idle_seconds: The idle time after which a session is ended.
+ */
+void run_udp_sessions(int port, const char *command, unsigned int idle_seconds)
+{
+    int server_fd = start_udp_server(port);
+    fcntl(server_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+    {
+        perror("epoll_create1");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event);
+    signal(SIGPIPE, SIG_IGN);
+    LOG_INFO("Serving UDP sessions on port %d, idle timeout %u seconds\n", port, idle_seconds);
+
+    std::unordered_map<uint64_t, struct udp_session *> sessions;
+    std::unordered_map<pid_t, struct udp_session *> children;
+    std::vector<struct udp_session *> ended;
+    static char buffer[RELAY_BUFFER_SIZE];
+    uint64_t idle_ns = (uint64_t)idle_seconds * 1000000000ull;
+    uint64_t next_sweep_ns = monotonic_ns() + 1000000000ull;
+
+    while (true)
+    {
+        struct epoll_event events[UDP_MAX_EVENTS];
+        int count = epoll_wait(epoll_fd, events, UDP_MAX_EVENTS, 1000);
+        if (count == -1 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            closeResourcesAndExit(EXIT_FAILURE);
+        }
+        uint64_t now = monotonic_ns();
+
+        for (int i = 0; i < count; i++)
+        {
+            struct udp_session *session = (struct udp_session *)events[i].data.ptr;
+            if (session != NULL && session->ended)
+                continue;
+            if (session != NULL)
+            {
+                // Output of a session's command, one write of the command is one datagram
+                ssize_t size = read(session->fd, buffer, sizeof(buffer));
+                if (size > 0)
+                {
+                    sendto(server_fd, buffer, size, 0, (struct sockaddr *)&session->peer, sizeof(session->peer));
+                    session->last_active_ns = now;
+                }
+                else if (size == 0 || errno != EAGAIN)
+                {
+                    udp_end_session(sessions, children, ended, session);
+                }
+                continue;
+            }
+
+            while (true)
+            {
+                struct sockaddr_in peer;
+                socklen_t peer_len = sizeof(peer);
+                ssize_t size = recvfrom(server_fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&peer, &peer_len);
+                if (size == -1)
+                    break;
+
+                std::unordered_map<uint64_t, struct udp_session *>::iterator found = sessions.find(udp_peer_key(&peer));
+                struct udp_session *peer_session;
+                if (found != sessions.end())
+                {
+                    peer_session = found->second;
+                }
+                else
+                {
+                    peer_session = udp_start_session(epoll_fd, &peer, command);
+                    if (peer_session == NULL)
+                        continue;
+                    sessions[udp_peer_key(&peer)] = peer_session;
+                    if (peer_session->pid > 0)
+                        children[peer_session->pid] = peer_session;
+                }
+                peer_session->last_active_ns = now;
+
+                if (peer_session->fd == -1)
+                {
+                    sendto(server_fd, buffer, size, 0, (struct sockaddr *)&peer, peer_len);
+                    continue;
+                }
+                // A session that cannot keep up loses the whole datagram, as UDP would. A
+                // seqpacket write takes all of it or nothing, a short count is a drop as well.
+                ssize_t written = write(peer_session->fd, buffer, size);
+                if (written == -1 && errno != EAGAIN && errno != ENOBUFS && errno != EMSGSIZE)
+                    udp_end_session(sessions, children, ended, peer_session);
+                else if (written != size)
+                    LOG_DEBUG("Session of port %d dropped a datagram of %zd bytes\n", ntohs(peer.sin_port), size);
+            }
+        }
+
+        pid_t pid;
+        int status;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            std::unordered_map<pid_t, struct udp_session *>::iterator reaped = children.find(pid);
+            if (reaped == children.end())
+                continue;
+            reaped->second->pid = 0;
+            children.erase(reaped);
+        }
+
+        if (now >= next_sweep_ns)
+        {
+            next_sweep_ns = now + 1000000000ull;
+            for (std::unordered_map<uint64_t, struct udp_session *>::iterator it = sessions.begin(); it != sessions.end();)
+            {
+                struct udp_session *session = it->second;
+                ++it;
+                if (now - session->last_active_ns >= idle_ns)
+                    udp_end_session(sessions, children, ended, session);
+            }
+        }
+
+        for (size_t i = 0; i < ended.size(); i++)
+            delete ended[i];
+        ended.clear();
+    }
+}
+
+#define MUX_HEADER_SIZE 8
+#define MUX_MAX_PAYLOAD 16384
+#define MUX_INITIAL_WINDOW 65536
+#define MUX_DEFAULT_WINDOW 262144
+#define MUX_MAX_WINDOW (64 << 20)
+#define MUX_MAX_LINKS 16
+#define MUX_LINK_HIGH_WATER 262144
+#define MUX_MAX_EVENTS 64
+#define MUX_CONNECT_TIMEOUT_MS 250
+#define MUX_UPSTREAM_TIMEOUT_NS 1000000000ull
+#define MUX_MAX_SEND_WINDOW 0x80000000u
+#define MUX_RETRY_MIN_NS 100000000ull
+#define MUX_RETRY_MAX_NS 5000000000ull
+
+/**
+ * Frames of the multiplexed link (-m). Every frame starts with an 8 byte header: the channel
+ * (4 bytes), the payload length (2 bytes), both in network order, the type and a reserved byte.
+ * OPEN starts a channel, DATA carries up to MUX_MAX_PAYLOAD bytes of it, WINDOW (a 4 byte
+ * increment) lets the peer send more, CLOSE ends one direction and RESET drops the channel.
+ */
+enum mux_frame_type
+{
+    MUX_OPEN,
+    MUX_DATA,
+    MUX_WINDOW,
+    MUX_CLOSE,
+    MUX_RESET
+};
+
+/**
+ * Settings of the multiplexed link, -m connect[,links=N][,window=bytes] on the side where the
+ * sessions arrive and -m accept[,window=bytes] on the side that serves them. window is how
+ * much of a channel each side buffers for the peer. A channel starts with MUX_INITIAL_WINDOW,
+ * a larger window is granted with a WINDOW frame right after the channel opened.
+ */
+struct mux_config
+{
+    bool connect;
+    int links;
+    uint32_t window;
+};
+
+struct mux_buffer
+{
+    char *data;
+    size_t start;
+    size_t end;
+    size_t capacity;
+};
+
+// What an epoll event points to, the first member of the link and channel structs
+enum mux_kind
+{
+    MUX_KIND_LINK,
+    MUX_KIND_CHANNEL
+};
+
+struct mux_link;
+
+/**
+ * A logical session carried over a link. fd is the accepted session on the connecting side,
+ * and the command's socketpair or the upstream connection on the accepting side.
+ * send_window is what the peer still accepts, consumed what was written to fd since the last
+ * WINDOW frame, and inbound the data from the link that fd did not take yet. An upstream
+ * connection is connecting until it is writable or connect_deadline_ns passed, inbound
+ * holds what the peer sent meanwhile.
+ */
+struct mux_channel
+{
+    enum mux_kind kind;
+    uint32_t id;
+    struct mux_link *link;
+    int fd;
+    pid_t pid;
+    uint32_t events;
+    uint32_t send_window;
+    uint32_t consumed;
+    struct mux_buffer inbound;
+    bool queued;
+    bool read_eof;
+    bool peer_closed;
+    bool ended;
+    bool connecting;
+    uint64_t connect_deadline_ns;
+};
+
+/**
+ * A TCP connection between the two mync instances. Frames to send are gathered in out and
+ * written once per round of events. runnable is the round-robin queue of channels with data
+ * to read, each gets one frame per turn while out is below MUX_LINK_HIGH_WATER.
+ */
+struct mux_link
+{
+    enum mux_kind kind;
+    int fd;
+    uint32_t events;
+    struct mux_buffer in;
+    struct mux_buffer out;
+    std::unordered_map<uint32_t, struct mux_channel *> channels;
+    std::deque<struct mux_channel *> runnable;
+    uint32_t next_id;
+    bool ended;
+};
+
+/**
+ * Connects that failed are not tried again before retry_ns, backoff_ns doubles with every
+ * failure in a row, so an unreachable peer does not stall the event loop on every session.
+ */
+struct mux_retry
+{
+    uint64_t retry_ns;
+    uint64_t backoff_ns;
+};
+
+/**
+ * The state of the multiplexer: the session or link listener, the links and the target of
+ * the accepting side. children maps the commands that were not reaped yet to their channels,
+ * connecting holds the channels whose upstream connect is in progress.
+ */
+struct mux_state
+{
+    struct mux_config config;
+    int epoll_fd;
+    int listen_fd;
+    char *hostname;
+    int port;
+    const char *command;
+    struct mux_link *links[MUX_MAX_LINKS];
+    int nlinks;
+    struct mux_retry link_retry;
+    struct mux_retry upstream_retry;
+    std::unordered_map<pid_t, struct mux_channel *> children;
+    std::vector<struct mux_channel *> connecting;
+    std::vector<struct mux_channel *> ended_channels;
+    std::vector<struct mux_link *> ended_links;
+};
+
+/**
+ * parse_mux_config: Parses the -m argument.
+ * @return 0 on success, -1 on an unknown key or a bad value.
+ */
+int parse_mux_config(char *spec, struct mux_config *config)
+{
+    config->links = 1;
+    config->window = MUX_DEFAULT_WINDOW;
+
+    char *item = strtok(spec, ",");
+    if (item == NULL || (strcmp(item, "connect") != 0 && strcmp(item, "accept") != 0))
+        return -1;
+    config->connect = strcmp(item, "connect") == 0;
+    for (item = strtok(NULL, ","); item != NULL; item = strtok(NULL, ","))
+    {
+        char *value = strchr(item, '=');
+        if (value == NULL)
+            return -1;
+        *value++ = '\0';
+        if (strcmp(item, "links") == 0 && config->connect)
+            config->links = atoi(value);
+        else if (strcmp(item, "window") == 0)
+            config->window = strtoul(value, NULL, 10);
+        else
+            return -1;
+    }
+    if (config->links < 1 || config->links > MUX_MAX_LINKS || config->window < MUX_INITIAL_WINDOW ||
+        config->window > MUX_MAX_WINDOW)
+        return -1;
+    return 0;
+}
+
+size_t mux_buffer_size(const struct mux_buffer *buffer)
+{
+    return buffer->end - buffer->start;
+}
+
+/**
+ * mux_buffer_reserve: Makes room for length more bytes at the end of a buffer.
+ * @return Where the bytes go.
+ */
+char *mux_buffer_reserve(struct mux_buffer *buffer, size_t length)
+{
+    if (buffer->start > 0 && buffer->end + length > buffer->capacity)
+    {
+        memmove(buffer->data, buffer->data + buffer->start, buffer->end - buffer->start);
+        buffer->end -= buffer->start;
+        buffer->start = 0;
+    }
+    if (buffer->end + length > buffer->capacity)
+    {
+        size_t capacity = buffer->capacity ? buffer->capacity : RELAY_BUFFER_SIZE;
+        while (capacity < buffer->end + length)
+            capacity *= 2;
+        char *data = (char *)realloc(buffer->data, capacity);
+        if (data == NULL)
+        {
+            perror("realloc");
+            closeResourcesAndExit(EXIT_FAILURE);
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    return buffer->data + buffer->end;
+}
+
+void mux_buffer_consume(struct mux_buffer *buffer, size_t length)
+{
+    buffer->start += length;
+    if (buffer->start == buffer->end)
+        buffer->start = buffer->end = 0;
+}
+
+/**
+ * mux_watch: Changes the events epoll watches on an fd. An fd without events is taken out of
+ *            epoll, which would otherwise keep reporting its hangup.
+ */
+void mux_watch(int epoll_fd, int fd, uint32_t *current, uint32_t events, void *ptr)
+{
+    if (*current == events)
+        return;
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = ptr;
+    epoll_ctl(epoll_fd, *current == 0 ? EPOLL_CTL_ADD : events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD, fd, &event);
+    *current = events;
+}
+
+/**
+ * mux_send_frame: Queues a frame on a link. DATA frames are built in place by mux_schedule().
+ */
+void mux_send_frame(struct mux_link *link, uint32_t id, uint8_t type, const void *payload, uint16_t length)
+{
+    char *frame = mux_buffer_reserve(&link->out, MUX_HEADER_SIZE + length);
+    uint32_t channel = htonl(id);
+    uint16_t size = htons(length);
+    memcpy(frame, &channel, sizeof(channel));
+    memcpy(frame + 4, &size, sizeof(size));
+    frame[6] = type;
+    frame[7] = 0;
+    memcpy(frame + MUX_HEADER_SIZE, payload, length);
+    link->out.end += MUX_HEADER_SIZE + length;
+}
+
+void mux_send_window(struct mux_link *link, uint32_t id, uint32_t increment)
+{
+    uint32_t value = htonl(increment);
+    mux_send_frame(link, id, MUX_WINDOW, &value, sizeof(value));
+}
+
+/**
+ * mux_channel_watch: Watches a channel's fd for what the channel can do: read while it is
+ *                    not queued and the peer has room, write while inbound holds data.
+ */
+void mux_channel_watch(struct mux_state *state, struct mux_channel *channel)
+{
+    uint32_t events = 0;
+    if (channel->connecting)
+        events = EPOLLOUT;
+    else if (!channel->queued && !channel->read_eof && channel->send_window > 0)
+        events |= EPOLLIN;
+    if (mux_buffer_size(&channel->inbound) > 0)
+        events |= EPOLLOUT;
+    mux_watch(state->epoll_fd, channel->fd, &channel->events, events, channel);
+}
+
+/**
+ * mux_end_channel: Removes a channel. The struct is freed after the current round of events,
+ *                  which may still point to it.
+ * @param reset: Tell the peer to drop the channel too.
+ */
+void mux_end_channel(struct mux_state *state, struct mux_channel *channel, bool reset)
+{
+    if (channel->ended)
+        return;
+    if (reset && !channel->link->ended)
+        mux_send_frame(channel->link, channel->id, MUX_RESET, NULL, 0);
+    LOG_DEBUG("Channel %u ended%s\n", channel->id, reset ? " (reset)" : "");
+    if (channel->queued)
+        channel->link->runnable.erase(std::find(channel->link->runnable.begin(), channel->link->runnable.end(), channel));
+    if (channel->connecting)
+        state->connecting.erase(std::find(state->connecting.begin(), state->connecting.end(), channel));
+    close(channel->fd);
+    // Only a command that was not reaped yet is signalled, its pid may belong to another process by now
+    if (channel->pid > 0)
+    {
+        kill(channel->pid, SIGTERM);
+        state->children.erase(channel->pid);
+    }
+    channel->ended = true;
+    channel->link->channels.erase(channel->id);
+    state->ended_channels.push_back(channel);
+}
+
+/**
+ * mux_add_channel: Starts a channel for an fd and grants the peer the configured window.
+ * @param connecting: The fd is an upstream connection whose connect is in progress.
+ */
+struct mux_channel *mux_add_channel(struct mux_state *state, struct mux_link *link, uint32_t id, int fd, pid_t pid,
+                                    bool connecting)
+{
+    struct mux_channel *channel = new mux_channel;
+    channel->kind = MUX_KIND_CHANNEL;
+    channel->id = id;
+    channel->link = link;
+    channel->fd = fd;
+    channel->pid = pid;
+    channel->events = EPOLLIN;
+    channel->send_window = MUX_INITIAL_WINDOW;
+    channel->consumed = 0;
+    memset(&channel->inbound, 0, sizeof(channel->inbound));
+    channel->queued = false;
+    channel->read_eof = false;
+    channel->peer_closed = false;
+    channel->ended = false;
+    channel->connecting = connecting;
+    if (connecting)
+    {
+        channel->events = EPOLLOUT;
+        channel->connect_deadline_ns = monotonic_ns() + MUX_UPSTREAM_TIMEOUT_NS;
+        state->connecting.push_back(channel);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    struct epoll_event event;
+    event.events = channel->events;
+    event.data.ptr = channel;
+    epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    link->channels[id] = channel;
+    if (pid > 0)
+        state->children[pid] = channel;
+    if (state->config.window > MUX_INITIAL_WINDOW)
+        mux_send_window(link, id, state->config.window - MUX_INITIAL_WINDOW);
+    return channel;
+}
+
+void mux_target(const struct mux_state *state, struct client_target *target)
+{
+    memset(target, 0, sizeof(*target));
+    target->kind = TARGET_TCP;
+    target->hostname = state->hostname;
+    target->port = state->port;
+}
+
+/**
+ * mux_connect_failed: Backs off after a failed connect, errno tells why it failed.
+ * @param what: What connects, for the log.
+ */
+void mux_connect_failed(struct mux_state *state, struct mux_retry *retry, const char *what)
+{
+    if (retry->backoff_ns == 0)
+        retry->backoff_ns = MUX_RETRY_MIN_NS;
+    else if (retry->backoff_ns * 2 < MUX_RETRY_MAX_NS)
+        retry->backoff_ns *= 2;
+    else
+        retry->backoff_ns = MUX_RETRY_MAX_NS;
+    retry->retry_ns = monotonic_ns() + retry->backoff_ns;
+    LOG_INFO("%s to %s:%d failed: %s, next try in %llu ms\n", what, state->hostname ?: "localhost", state->port,
+             strerror(errno), (unsigned long long)(retry->backoff_ns / 1000000));
+}
+
+/**
+ * mux_connect: Connects to the TCPC endpoint, unless an earlier failure is still backing off.
+ *              The connect waits at most MUX_CONNECT_TIMEOUT_MS, since it holds up every channel.
+ * @param what: What connects, for the log.
+ * @return The connected socket, or -1 on failure.
+ */
+int mux_connect(struct mux_state *state, struct mux_retry *retry, const char *what)
+{
+    if (monotonic_ns() < retry->retry_ns)
+        return -1;
+    struct client_target target;
+    mux_target(state, &target);
+    int fd = connect_backend(&target, MUX_CONNECT_TIMEOUT_MS);
+    if (fd != -1)
+    {
+        retry->backoff_ns = 0;
+        return fd;
+    }
+    mux_connect_failed(state, retry, what);
+    return -1;
+}
+
+/**
+ * mux_open_upstream: Opens what serves a channel on the accepting side, the command on a
+ *                    socketpair or a connection to the upstream. The upstream connect only
+ *                    starts here, the event loop completes it, see mux_upstream_connected().
+ * @param connecting: Set if the fd is an upstream connection still connecting.
+ * @return The fd, or -1 on failure.
+ */
+int mux_open_upstream(struct mux_state *state, pid_t *pid, bool *connecting)
+{
+    *pid = 0;
+    *connecting = false;
+    if (state->command == NULL)
+    {
+        if (monotonic_ns() < state->upstream_retry.retry_ns)
+            return -1;
+        struct client_target target;
+        mux_target(state, &target);
+        int fd = connect_backend_start(&target);
+        if (fd == -1)
+            mux_connect_failed(state, &state->upstream_retry, "Upstream");
+        *connecting = (fd != -1);
+        return fd;
+    }
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1)
+    {
+        perror("socketpair");
+        return -1;
+    }
+    int parent_fds[] = {pair[0], state->listen_fd, state->epoll_fd, -1};
+    spawn_command(state->command, pair[1], pair[1], parent_fds);
+    *pid = child;
+    child = 0;
+    close(pair[1]);
+    return pair[0];
+}
+
+/**
+ * mux_write_inbound: Writes the data that came from the link to the channel's fd. Every half
+ *                    window written is granted back to the peer, and once the peer closed its
+ *                    direction and everything was written, fd gets the end of file.
+ */
+void mux_write_inbound(struct mux_state *state, struct mux_channel *channel)
+{
+    if (channel->connecting)
+        return;
+    while (mux_buffer_size(&channel->inbound) > 0)
+    {
+        ssize_t written = write(channel->fd, channel->inbound.data + channel->inbound.start, mux_buffer_size(&channel->inbound));
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                mux_end_channel(state, channel, true);
+            break;
+        }
+        mux_buffer_consume(&channel->inbound, written);
+        channel->consumed += written;
+    }
+    if (channel->ended)
+        return;
+    if (channel->consumed >= state->config.window / 2)
+    {
+        mux_send_window(channel->link, channel->id, channel->consumed);
+        channel->consumed = 0;
+    }
+    if (channel->peer_closed && mux_buffer_size(&channel->inbound) == 0)
+    {
+        shutdown(channel->fd, SHUT_WR);
+        if (channel->read_eof)
+        {
+            mux_end_channel(state, channel, false);
+            return;
+        }
+    }
+    mux_channel_watch(state, channel);
+}
+
+/**
+ * mux_upstream_connected: Completes the upstream connect of a channel once its socket is
+ *                         writable, then writes what the peer sent meanwhile. A connect that
+ *                         failed or timed out resets the channel and backs off.
+ */
+void mux_upstream_connected(struct mux_state *state, struct mux_channel *channel, bool timed_out)
+{
+    int error = timed_out ? ETIMEDOUT : connect_error(channel->fd);
+    if (error != 0)
+    {
+        errno = error;
+        mux_connect_failed(state, &state->upstream_retry, "Upstream");
+        LOG_INFO("Channel %u: upstream unreachable\n", channel->id);
+        mux_end_channel(state, channel, true);
+        return;
+    }
+    state->connecting.erase(std::find(state->connecting.begin(), state->connecting.end(), channel));
+    channel->connecting = false;
+    state->upstream_retry.backoff_ns = 0;
+    mux_write_inbound(state, channel);
+}
+
+/**
+ * mux_handle_frame: Acts on a frame received on a link.
+ */
+void mux_handle_frame(struct mux_state *state, struct mux_link *link, uint32_t id, uint8_t type, const char *payload, uint16_t length)
+{
+    std::unordered_map<uint32_t, struct mux_channel *>::iterator found = link->channels.find(id);
+    struct mux_channel *channel = found != link->channels.end() ? found->second : NULL;
+
+    if (type == MUX_OPEN)
+    {
+        if (state->config.connect || channel != NULL)
+            return;
+        pid_t pid;
+        bool connecting;
+        int fd = mux_open_upstream(state, &pid, &connecting);
+        if (fd == -1)
+        {
+            LOG_INFO("Channel %u: upstream unreachable\n", id);
+            mux_send_frame(link, id, MUX_RESET, NULL, 0);
+            return;
+        }
+        mux_add_channel(state, link, id, fd, pid, connecting);
+        LOG_DEBUG("Channel %u opened\n", id);
+        return;
+    }
+    // Frames of a channel that ended on this side are dropped
+    if (channel == NULL)
+        return;
+    if (type == MUX_DATA)
+    {
+        if (mux_buffer_size(&channel->inbound) + length > state->config.window)
+        {
+            LOG_INFO("Channel %u: peer overran its window\n", id);
+            mux_end_channel(state, channel, true);
+            return;
+        }
+        memcpy(mux_buffer_reserve(&channel->inbound, length), payload, length);
+        channel->inbound.end += length;
+        mux_write_inbound(state, channel);
+    }
+    else if (type == MUX_WINDOW && length == sizeof(uint32_t))
+    {
+        uint32_t increment;
+        memcpy(&increment, payload, sizeof(increment));
+        increment = ntohl(increment);
+        // A window the peer cannot have buffered, and past this it would wrap
+        if (increment > MUX_MAX_SEND_WINDOW - channel->send_window)
+        {
+            LOG_INFO("Channel %u: peer opened its window past %u bytes\n", id, MUX_MAX_SEND_WINDOW);
+            mux_end_channel(state, channel, true);
+            return;
+        }
+        channel->send_window += increment;
+        mux_channel_watch(state, channel);
+    }
+    else if (type == MUX_CLOSE)
+    {
+        channel->peer_closed = true;
+        mux_write_inbound(state, channel);
+    }
+    else if (type == MUX_RESET)
+    {
+        mux_end_channel(state, channel, false);
+    }
+}
+
+/**
+ * mux_end_link: Drops a link that failed and every channel on it.
+ */
+void mux_end_link(struct mux_state *state, struct mux_link *link)
+{
+    LOG_INFO("Link %d closed, dropping %zu channels\n", link->fd, link->channels.size());
+    link->ended = true;
+    while (!link->channels.empty())
+        mux_end_channel(state, link->channels.begin()->second, false);
+    close(link->fd);
+    for (int i = 0; i < state->nlinks; i++)
+    {
+        if (state->links[i] == link)
+            state->links[i] = state->links[--state->nlinks];
+    }
+    state->ended_links.push_back(link);
+}
+
+/**
+ * mux_add_link: Starts a link on a connected socket.
+ */
+struct mux_link *mux_add_link(struct mux_state *state, int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    struct mux_link *link = new mux_link;
+    link->kind = MUX_KIND_LINK;
+    link->fd = fd;
+    link->events = EPOLLIN;
+    memset(&link->in, 0, sizeof(link->in));
+    memset(&link->out, 0, sizeof(link->out));
+    link->next_id = 1;
+    link->ended = false;
+    struct epoll_event event;
+    event.events = link->events;
+    event.data.ptr = link;
+    epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    state->links[state->nlinks++] = link;
+    LOG_INFO("Link %d up\n", fd);
+    return link;
+}
+
+/**
+ * mux_read_link: Reads what arrived on a link and handles its complete frames.
+ */
+void mux_read_link(struct mux_state *state, struct mux_link *link)
+{
+    while (!link->ended)
+    {
+        ssize_t size = read(link->fd, mux_buffer_reserve(&link->in, RELAY_BUFFER_SIZE), RELAY_BUFFER_SIZE);
+        if (size == -1 && errno == EINTR)
+            continue;
+        if (size == -1 && errno == EAGAIN)
+            break;
+        if (size <= 0)
+        {
+            mux_end_link(state, link);
+            return;
+        }
+        link->in.end += size;
+
+        while (mux_buffer_size(&link->in) >= MUX_HEADER_SIZE && !link->ended)
+        {
+            const char *frame = link->in.data + link->in.start;
+            uint32_t id;
+            uint16_t length;
+            memcpy(&id, frame, sizeof(id));
+            memcpy(&length, frame + 4, sizeof(length));
+            length = ntohs(length);
+            if (length > MUX_MAX_PAYLOAD)
+            {
+                fprintf(stderr, "Invalid link frame length %u\n", length);
+                mux_end_link(state, link);
+                return;
+            }
+            if (mux_buffer_size(&link->in) < MUX_HEADER_SIZE + (size_t)length)
+                break;
+            mux_handle_frame(state, link, ntohl(id), frame[6], frame + MUX_HEADER_SIZE, length);
+            mux_buffer_consume(&link->in, MUX_HEADER_SIZE + length);
+        }
+    }
+}
+
+/**
+ * mux_schedule: Moves channel data onto a link, one frame per runnable channel in turn,
+ *               until the link has MUX_LINK_HIGH_WATER bytes waiting. The data is read
+ *               straight into the link's buffer behind the frame header.
+ */
+void mux_schedule(struct mux_state *state, struct mux_link *link)
+{
+    while (!link->runnable.empty() && mux_buffer_size(&link->out) < MUX_LINK_HIGH_WATER)
+    {
+        struct mux_channel *channel = link->runnable.front();
+        link->runnable.pop_front();
+        channel->queued = false;
+        size_t quantum = channel->send_window < MUX_MAX_PAYLOAD ? channel->send_window : MUX_MAX_PAYLOAD;
+        ssize_t size = read(channel->fd, mux_buffer_reserve(&link->out, MUX_HEADER_SIZE + quantum) + MUX_HEADER_SIZE, quantum);
+        if (size > 0)
+        {
+            char *frame = link->out.data + link->out.end;
+            uint32_t id = htonl(channel->id);
+            uint16_t length = htons(size);
+            memcpy(frame, &id, sizeof(id));
+            memcpy(frame + 4, &length, sizeof(length));
+            frame[6] = MUX_DATA;
+            frame[7] = 0;
+            link->out.end += MUX_HEADER_SIZE + size;
+            channel->send_window -= size;
+            // A full quantum may have left more, the channel goes to the back of the queue
+            if ((size_t)size == quantum && channel->send_window > 0)
+            {
+                channel->queued = true;
+                link->runnable.push_back(channel);
+                continue;
+            }
+        }
+        else if (size == 0)
+        {
+            channel->read_eof = true;
+            mux_send_frame(link, channel->id, MUX_CLOSE, NULL, 0);
+            if (channel->peer_closed && mux_buffer_size(&channel->inbound) == 0)
+            {
+                mux_end_channel(state, channel, false);
+                continue;
+            }
+        }
+        else if (errno != EAGAIN && errno != EINTR)
+        {
+            mux_end_channel(state, channel, true);
+            continue;
+        }
+        mux_channel_watch(state, channel);
+    }
+}
+
+/**
+ * mux_flush_link: Writes a link's queued frames, the rest waits for the link to be writable.
+ */
+void mux_flush_link(struct mux_state *state, struct mux_link *link)
+{
+    while (mux_buffer_size(&link->out) > 0)
+    {
+        ssize_t written = write(link->fd, link->out.data + link->out.start, mux_buffer_size(&link->out));
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+            {
+                mux_end_link(state, link);
+                return;
+            }
+            break;
+        }
+        mux_buffer_consume(&link->out, written);
+    }
+    mux_watch(state->epoll_fd, link->fd, &link->events, mux_buffer_size(&link->out) > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN, link);
+}
+
+/**
+ * mux_pick_link: Picks the link with the fewest channels for a new session, and reconnects
+ *                the links that went down.
+ * @return The link, or NULL if the peer cannot be reached.
+ */
+struct mux_link *mux_pick_link(struct mux_state *state)
+{
+    while (state->nlinks < state->config.links)
+    {
+        int fd = mux_connect(state, &state->link_retry, "Link");
+        if (fd == -1)
+            break;
+        mux_add_link(state, fd);
+    }
+    struct mux_link *best = NULL;
+    for (int i = 0; i < state->nlinks; i++)
+    {
+        if (best == NULL || state->links[i]->channels.size() < best->channels.size())
+            best = state->links[i];
+    }
+    return best;
+}
+
+/**
+ * run_mux: Carries many sessions over a few TCP connections between two mync instances.
+ *          The connecting side accepts sessions on listen_fd and opens a channel for each on
+ *          the least loaded link. The accepting side accepts links on listen_fd and serves
+ *          each channel with the command or a connection to the upstream. This function never
+ *          returns.
+ * @param state: The configuration, listener and target, the rest is set up here.
+ */
+void run_mux(struct mux_state *state)
+{
+    state->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (state->epoll_fd == -1)
+    {
+        perror("epoll_create1");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    fcntl(state->listen_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(state->listen_fd, F_SETFL, fcntl(state->listen_fd, F_GETFL) | O_NONBLOCK);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD, state->listen_fd, &event);
+    signal(SIGPIPE, SIG_IGN);
+    state->nlinks = 0;
+    if (state->config.connect)
+        mux_pick_link(state);
+    LOG_INFO("Multiplexing %s, window %u bytes\n", state->config.connect ? "sessions onto links" : "links into sessions",
+             state->config.window);
+
+    while (true)
+    {
+        // Wake up for the first upstream connect that times out
+        int timeout = -1;
+        if (!state->connecting.empty())
+        {
+            uint64_t deadline = UINT64_MAX;
+            for (struct mux_channel *channel : state->connecting)
+                deadline = std::min(deadline, channel->connect_deadline_ns);
+            uint64_t now = monotonic_ns();
+            timeout = deadline > now ? (deadline - now + 999999) / 1000000 : 0;
+        }
+        struct epoll_event events[MUX_MAX_EVENTS];
+        int count = epoll_wait(state->epoll_fd, events, MUX_MAX_EVENTS, timeout);
+        if (count == -1 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            closeResourcesAndExit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            enum mux_kind *kind = (enum mux_kind *)events[i].data.ptr;
+            if (kind == NULL)
+            {
+                int fd;
+                while ((fd = accept4(state->listen_fd, NULL, NULL, SOCK_CLOEXEC)) != -1)
+                {
+                    if (!state->config.connect)
+                    {
+                        mux_add_link(state, fd);
+                        continue;
+                    }
+                    struct mux_link *link = mux_pick_link(state);
+                    if (link == NULL)
+                    {
+                        close(fd);
+                        continue;
+                    }
+                    uint32_t id = link->next_id++;
+                    mux_send_frame(link, id, MUX_OPEN, NULL, 0);
+                    mux_add_channel(state, link, id, fd, 0, false);
+                    LOG_DEBUG("Session %d on channel %u of link %d\n", fd, id, link->fd);
+                }
+            }
+            else if (*kind == MUX_KIND_LINK)
+            {
+                struct mux_link *link = (struct mux_link *)kind;
+                if (link->ended)
+                    continue;
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                    mux_read_link(state, link);
+                if (!link->ended && (events[i].events & EPOLLOUT))
+                    mux_flush_link(state, link);
+            }
+            else
+            {
+                struct mux_channel *channel = (struct mux_channel *)kind;
+                if (channel->ended)
+                    continue;
+                if (channel->connecting)
+                {
+                    mux_upstream_connected(state, channel, false);
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT)
+                    mux_write_inbound(state, channel);
+                // The other end is gone and there is nothing left to read
+                if (!channel->ended && (events[i].events & (EPOLLHUP | EPOLLERR)) && channel->read_eof)
+                    mux_end_channel(state, channel, true);
+                if (!channel->ended && !channel->queued && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+                    (channel->events & EPOLLIN))
+                {
+                    channel->queued = true;
+                    channel->link->runnable.push_back(channel);
+                    mux_channel_watch(state, channel);
+                }
+            }
+        }
+
+        uint64_t now = monotonic_ns();
+        for (size_t i = 0; i < state->connecting.size();)
+        {
+            // A channel that ends leaves the vector, the next one takes its place
+            if (now >= state->connecting[i]->connect_deadline_ns)
+                mux_upstream_connected(state, state->connecting[i], true);
+            else
+                i++;
+        }
+
+        // One write per link for all the frames of this round, more rounds while the link
+        // takes everything and channels are still waiting
+        for (int i = 0; i < state->nlinks; i++)
+        {
+            struct mux_link *link = state->links[i];
+            do
+            {
+                mux_schedule(state, link);
+                mux_flush_link(state, link);
+            } while (!link->ended && !link->runnable.empty() && mux_buffer_size(&link->out) == 0);
+            if (link->ended)
+                i--;
+        }
+
+        pid_t pid;
+        int status;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            std::unordered_map<pid_t, struct mux_channel *>::iterator reaped = state->children.find(pid);
+            if (reaped == state->children.end())
+                continue;
+            reaped->second->pid = 0;
+            state->children.erase(reaped);
+        }
+        for (size_t i = 0; i < state->ended_channels.size(); i++)
+        {
+            free(state->ended_channels[i]->inbound.data);
+            delete state->ended_channels[i];
+        }
+        state->ended_channels.clear();
+        for (size_t i = 0; i < state->ended_links.size(); i++)
+        {
+            free(state->ended_links[i]->in.data);
+            free(state->ended_links[i]->out.data);
+            delete state->ended_links[i];
+        }
+        state->ended_links.clear();
+    }
+}
+
+#define LOADGEN_PROMPT "Choose a location"
+#define LOADGEN_CONNECT_TIMEOUT_MS 1000
+#define LOADGEN_RETRY_MIN_NS 10000000ull
+#define LOADGEN_RETRY_MAX_NS 1000000000ull
+#define LOADGEN_RESPONSE_TIMEOUT_NS 1000000000ull
+
+/**
+ * Settings of the load generator (-L), given as comma separated key=value pairs.
+ * rate is the total request rate over all connections, 0 sends the next request as soon as
+ * the previous response arrived. expect is the response size in bytes, 0 for no response.
+ * moves is a ttt move script; when it is set, a request is one move and its response ends
+ * with the next prompt or the end of the game, after which the connection is reopened.
+ */
+struct loadgen_config
+{
+    struct client_target target;
+    int connections;
+    int threads;
+    size_t size;
+    double rate;
+    double duration;
+    size_t expect;
+    const char *moves;
+};
+
+/**
+ * A connection of the load generator. fd is -1 while a failed session waits for retry_ns,
+ * backoff_ns doubles with every failure until the server answers again.
+ */
+struct loadgen_connection
+{
+    int fd;
+    bool ready;
+    bool waiting;
+    uint64_t connect_ns;
+    uint64_t retry_ns;
+    uint64_t backoff_ns;
+    uint64_t intended_ns;
+    uint64_t sent_ns;
+    uint64_t next_ns;
+    size_t received;
+    size_t move;
+    char tail[sizeof(LOADGEN_PROMPT)];
+    size_t tail_len;
+};
+
+struct loadgen_thread
+{
+    const struct loadgen_config *config;
+    int count;
+    int offset;
+    pthread_t thread;
+    uint64_t start_ns;
+    struct latency_histogram latency;
+    struct latency_histogram setup;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t games;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+};
+
+/**
+ * parse_loadgen_config: Parses the -L argument, keys that are not given keep their defaults.
+ * @return 0 on success, -1 on an unknown key or a bad value.
+ */
+int parse_loadgen_config(char *spec, struct loadgen_config *config)
+{
+    config->connections = 1;
+    config->threads = 1;
+    config->size = 64;
+    config->rate = 0;
+    config->duration = 10;
+    config->expect = (size_t)-1;
+    config->moves = NULL;
+
+    for (char *item = strtok(spec, ","); item != NULL; item = strtok(NULL, ","))
+    {
+        char *value = strchr(item, '=');
+        if (value == NULL)
+            return -1;
+        *value++ = '\0';
+        if (strcmp(item, "conns") == 0)
+            config->connections = atoi(value);
+        else if (strcmp(item, "threads") == 0)
+            config->threads = atoi(value);
+        else if (strcmp(item, "size") == 0)
+            config->size = atoi(value);
+        else if (strcmp(item, "rate") == 0)
+            config->rate = atof(value);
+        else if (strcmp(item, "duration") == 0)
+            config->duration = atof(value);
+        else if (strcmp(item, "expect") == 0)
+            config->expect = atoi(value);
+        else if (strcmp(item, "moves") == 0)
+            config->moves = value;
+        else
+            return -1;
+    }
+    // By default a response is as long as the request, which fits an echo server
+    if (config->expect == (size_t)-1)
+        config->expect = config->size;
+    if (config->threads > config->connections)
+        config->threads = config->connections;
+    if (config->connections <= 0 || config->threads <= 0 || config->size == 0 || config->rate < 0 ||
+        config->duration <= 0 || (config->moves != NULL && *config->moves == '\0'))
+        return -1;
+    return 0;
+}
+
+/**
+ * loadgen_retry: Closes a failed connection and schedules the next connect after a backoff,
+ *                so a server that is away does not end the run or get flooded.
+ */
+void loadgen_retry(struct loadgen_connection *connection)
+{
+    if (connection->fd != -1)
+        close(connection->fd);
+    connection->fd = -1;
+    connection->ready = false;
+    connection->waiting = false;
+    if (connection->backoff_ns == 0)
+        connection->backoff_ns = LOADGEN_RETRY_MIN_NS;
+    else if (connection->backoff_ns * 2 < LOADGEN_RETRY_MAX_NS)
+        connection->backoff_ns *= 2;
+    else
+        connection->backoff_ns = LOADGEN_RETRY_MAX_NS;
+    connection->retry_ns = monotonic_ns() + connection->backoff_ns;
+}
+
+/**
+ * loadgen_connect: Opens a connection, a failure counts as an error and is retried later.
+ */
+void loadgen_connect(struct loadgen_thread *state, struct loadgen_connection *connection)
+{
+    connection->connect_ns = monotonic_ns();
+    connection->fd = connect_backend(&state->config->target, LOADGEN_CONNECT_TIMEOUT_MS);
+    connection->waiting = false;
+    connection->received = 0;
+    connection->move = 0;
+    connection->tail_len = 0;
+    if (connection->fd == -1)
+    {
+        state->errors++;
+        loadgen_retry(connection);
+        return;
+    }
+    // A ttt session is ready once it prompts for the first move
+    connection->ready = (state->config->moves == NULL);
+    if (connection->ready)
+        latency_record(&state->setup, monotonic_ns() - connection->connect_ns);
+}
+
+void loadgen_complete(struct loadgen_thread *state, struct loadgen_connection *connection, uint64_t now)
+{
+    latency_record(&state->latency, now - connection->intended_ns);
+    state->requests++;
+    connection->waiting = false;
+    if (state->config->rate == 0)
+        connection->next_ns = now;
+}
+
+/**
+ * loadgen_received: Accounts for response data and completes the request it finishes.
+ *                   In script mode it looks for the ttt prompt, also across chunk boundaries.
+ */
+void loadgen_received(struct loadgen_thread *state, struct loadgen_connection *connection, const char *data, size_t length, uint64_t now)
+{
+    state->bytes_received += length;
+    connection->backoff_ns = 0;
+    if (state->config->moves == NULL)
+    {
+        connection->received += length;
+        if (connection->waiting && connection->received >= state->config->expect)
+        {
+            connection->received -= state->config->expect;
+            loadgen_complete(state, connection, now);
+        }
+        return;
+    }
+
+    const size_t prompt_len = sizeof(LOADGEN_PROMPT) - 1;
+    bool prompted = false;
+    // The bytes kept from the previous chunk plus the start of this one
+    char joined[2 * sizeof(LOADGEN_PROMPT)];
+    size_t head = length < prompt_len ? length : prompt_len;
+    memcpy(joined, connection->tail, connection->tail_len);
+    memcpy(joined + connection->tail_len, data, head);
+    if (memmem(joined, connection->tail_len + head, LOADGEN_PROMPT, prompt_len) != NULL ||
+        memmem(data, length, LOADGEN_PROMPT, prompt_len) != NULL)
+        prompted = true;
+    size_t keep = length < prompt_len - 1 ? length : prompt_len - 1;
+    if (connection->tail_len + keep > prompt_len - 1)
+    {
+        size_t drop = connection->tail_len + keep - (prompt_len - 1);
+        memmove(connection->tail, connection->tail + drop, connection->tail_len - drop);
+        connection->tail_len -= drop;
+    }
+    memcpy(connection->tail + connection->tail_len, data + length - keep, keep);
+    connection->tail_len += keep;
+
+    if (!prompted)
+        return;
+    if (!connection->ready)
+    {
+        connection->ready = true;
+        latency_record(&state->setup, now - connection->connect_ns);
+        if (state->config->rate == 0)
+            connection->next_ns = now;
+    }
+    else if (connection->waiting)
+    {
+        loadgen_complete(state, connection, now);
+    }
+}
+
+void loadgen_send(struct loadgen_thread *state, struct loadgen_connection *connection, const char *payload, uint64_t interval_ns, uint64_t now)
+{
+    const struct loadgen_config *config = state->config;
+    char move[2];
+    const char *data = payload;
+    size_t length = config->size;
+    if (config->moves != NULL)
+    {
+        move[0] = config->moves[connection->move++ % strlen(config->moves)];
+        move[1] = '\n';
+        data = move;
+        length = 2;
+    }
+
+    // The latency clock starts at the intended time, so a late send does not hide queueing
+    connection->intended_ns = (config->rate > 0) ? connection->next_ns : now;
+    connection->next_ns += interval_ns;
+    connection->sent_ns = now;
+    connection->waiting = true;
+    if (send(connection->fd, data, length, MSG_NOSIGNAL) != (ssize_t)length)
+    {
+        // A connection that failed a send is not used again, it is reopened after a backoff
+        state->errors++;
+        loadgen_retry(connection);
+        return;
+    }
+    state->bytes_sent += length;
+    if (config->moves == NULL && config->expect == 0)
+        loadgen_complete(state, connection, monotonic_ns());
+}
+
+/**
+ * loadgen_run_thread: Drives the connections of one thread until the test duration is over.
+ */
+void *loadgen_run_thread(void *arg)
+{
+    struct loadgen_thread *state = (struct loadgen_thread *)arg;
+    const struct loadgen_config *config = state->config;
+    uint64_t interval_ns = (config->rate > 0) ? (uint64_t)(1e9 * config->connections / config->rate) : 0;
+    uint64_t end_ns = state->start_ns + (uint64_t)(config->duration * 1e9);
+
+    char *payload = (char *)malloc(config->size);
+    static char buffer[RELAY_BUFFER_SIZE];
+    char *chunk = buffer;
+    if (config->threads > 1)
+        chunk = (char *)malloc(RELAY_BUFFER_SIZE);
+    struct loadgen_connection *connections = (struct loadgen_connection *)calloc(state->count, sizeof(struct loadgen_connection));
+    struct pollfd *pfds = (struct pollfd *)calloc(state->count, sizeof(struct pollfd));
+    if (payload == NULL || chunk == NULL || connections == NULL || pfds == NULL)
+    {
+        perror("malloc");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    memset(payload, 'x', config->size);
+    payload[config->size - 1] = '\n';
+    for (int i = 0; i < state->count; i++)
+    {
+        loadgen_connect(state, &connections[i]);
+        // Spread the first requests over one interval instead of sending them all at once
+        connections[i].next_ns = state->start_ns + interval_ns * (state->offset + i) / config->connections;
+    }
+
+    // A lost datagram is never answered, such a connection is reopened after a timeout
+    bool datagrams = config->target.kind == TARGET_UDP || config->target.kind == TARGET_UDS_DATAGRAM;
+    uint64_t now = monotonic_ns();
+    while (now < end_ns)
+    {
+        uint64_t wake_ns = end_ns;
+        for (int i = 0; i < state->count; i++)
+        {
+            struct loadgen_connection *connection = &connections[i];
+            pfds[i].fd = connection->fd;
+            pfds[i].events = POLLIN;
+            if (connection->fd == -1 && connection->retry_ns < wake_ns)
+                wake_ns = connection->retry_ns;
+            if (connection->ready && !connection->waiting && connection->next_ns < wake_ns)
+                wake_ns = connection->next_ns;
+            if (datagrams && connection->fd != -1 && (connection->waiting || !connection->ready))
+            {
+                uint64_t since_ns = connection->waiting ? connection->sent_ns : connection->connect_ns;
+                if (since_ns + LOADGEN_RESPONSE_TIMEOUT_NS < wake_ns)
+                    wake_ns = since_ns + LOADGEN_RESPONSE_TIMEOUT_NS;
+            }
+        }
+        // ppoll keeps the schedule at nanosecond resolution instead of rounding to milliseconds
+        struct timespec timeout;
+        timeout.tv_sec = (wake_ns > now) ? (wake_ns - now) / 1000000000ull : 0;
+        timeout.tv_nsec = (wake_ns > now) ? (wake_ns - now) % 1000000000ull : 0;
+        if (ppoll(pfds, state->count, &timeout, NULL) == -1 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+
+        now = monotonic_ns();
+        for (int i = 0; i < state->count; i++)
+        {
+            struct loadgen_connection *connection = &connections[i];
+            bool reopen = false;
+            if (connection->fd == -1)
+            {
+                reopen = now >= connection->retry_ns;
+            }
+            else if (pfds[i].revents != 0)
+            {
+                ssize_t size = recv(connection->fd, chunk, RELAY_BUFFER_SIZE, MSG_DONTWAIT);
+                if (size > 0)
+                {
+                    loadgen_received(state, connection, chunk, size, now);
+                    continue;
+                }
+                if (size == -1 && (errno == EAGAIN || errno == EINTR))
+                    continue;
+
+                // In script mode the server ends the session with the game, which answers the last move
+                if (config->moves != NULL && size == 0 && connection->ready)
+                {
+                    if (connection->waiting)
+                        loadgen_complete(state, connection, now);
+                    state->games++;
+                }
+                else
+                {
+                    state->errors++;
+                    loadgen_retry(connection);
+                    continue;
+                }
+                reopen = true;
+            }
+            else if (datagrams && (connection->waiting || !connection->ready) &&
+                     now >= (connection->waiting ? connection->sent_ns : connection->connect_ns) + LOADGEN_RESPONSE_TIMEOUT_NS)
+            {
+                state->errors++;
+                loadgen_retry(connection);
+                continue;
+            }
+            if (!reopen)
+                continue;
+            uint64_t next_ns = connection->next_ns;
+            if (connection->fd != -1)
+                close(connection->fd);
+            loadgen_connect(state, connection);
+            connection->next_ns = (config->rate > 0) ? next_ns : monotonic_ns();
+        }
+
+        for (int i = 0; i < state->count; i++)
+        {
+            if (connections[i].ready && !connections[i].waiting && connections[i].next_ns <= now)
+                loadgen_send(state, &connections[i], payload, interval_ns, now);
+        }
+    }
+
+    for (int i = 0; i < state->count; i++)
+    {
+        if (connections[i].fd != -1)
+            close(connections[i].fd);
+    }
+    free(connections);
+    free(pfds);
+    free(payload);
+    if (chunk != buffer)
+        free(chunk);
+    return NULL;
+}
+
+/**
+ * run_loadgen: Runs the load generator against a client endpoint and prints a report.
+ *              Latencies are measured from the time a request was scheduled to be sent,
+ *              so with a rate a slow server cannot hide its queueing delay by delaying
+ *              the requests (coordinated omission). This function never returns.
+ */
+void run_loadgen(const struct loadgen_config *config)
+{
+    signal(SIGPIPE, SIG_IGN);
+    struct loadgen_thread *threads = (struct loadgen_thread *)calloc(config->threads, sizeof(struct loadgen_thread));
+    if (threads == NULL)
+    {
+        perror("calloc");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
+    uint64_t start_ns = monotonic_ns();
+    int offset = 0;
+    for (int i = 0; i < config->threads; i++)
+    {
+        threads[i].config = config;
+        threads[i].count = config->connections / config->threads + (i < config->connections % config->threads ? 1 : 0);
+        threads[i].offset = offset;
+        threads[i].start_ns = start_ns;
+        offset += threads[i].count;
+        if (pthread_create(&threads[i].thread, NULL, loadgen_run_thread, &threads[i]) != 0)
+        {
+            fprintf(stderr, "Failed to start load generator thread\n");
+            closeResourcesAndExit(EXIT_FAILURE);
+        }
+    }
+
+    struct loadgen_thread total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < config->threads; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        latency_merge(&total.latency, &threads[i].latency);
+        latency_merge(&total.setup, &threads[i].setup);
+        total.requests += threads[i].requests;
+        total.errors += threads[i].errors;
+        total.games += threads[i].games;
+        total.bytes_sent += threads[i].bytes_sent;
+        total.bytes_received += threads[i].bytes_received;
+    }
+    double elapsed = (monotonic_ns() - start_ns) / 1e9;
+
+    printf("Load: %d connections on %d threads for %.1f s, %s\n", config->connections, config->threads, elapsed,
+           config->rate > 0 ? "open loop" : "closed loop");
+    printf("Requests: %llu completed, %llu errors, %.1f requests/s\n", (unsigned long long)total.requests,
+           (unsigned long long)total.errors, total.requests / elapsed);
+    if (config->moves != NULL)
+        printf("Games: %llu completed\n", (unsigned long long)total.games);
+    printf("Throughput: %.3f MB/s sent, %.3f MB/s received\n", total.bytes_sent / elapsed / 1e6, total.bytes_received / elapsed / 1e6);
+    latency_print(stdout, config->rate > 0 ? "Latency (from intended send time)" : "Latency", &total.latency);
+    latency_print(stdout, "Session setup", &total.setup);
+    free(threads);
+    closeResourcesAndExit(EXIT_SUCCESS);
+}
+
+char *extract_path(const char *arg)
+{
+    // Find the "-i " option
+    const char *start = strstr(arg, "UDS");
     if (start == NULL || (strlen(start) <= 5))
     {
         return NULL;
@@ -494,7 +6402,7 @@ char *extract_path(const char *arg)
 
 void print_usage(const char *progname)
 {
-    printf("Usage: %s [-e command] [-t time] [-i|-o|-b argument]\n", progname);
+    printf("Usage: %s [-e command] [-t time] [-i|-o|-b argument] [-a control_socket [-H restart_socket] | -w control_socket [-P warm=N,idle=seconds,max=N]] [-c capture_file[,MB]] [-r capture_file[,speed[,I|O]]] [-L key=value,...] [-s idle_seconds] [-z zerocopy_bytes] [-T rate[,trace_file]] [-F flush_usec[,frame]] [-m connect|accept[,links=N][,window=bytes]] [-R] [-v...] [-l log_file]\n", progname);
 }
 
 int main(int argc, char *argv[])
@@ -517,57 +6425,256 @@ int main(int argc, char *argv[])
     bool udscs = false;
     bool udssd = false;
     bool udscd = false;
+    bool udssp = false;
+    bool udscp = false;
+    char *acceptor_path = NULL;
+    char *worker_path = NULL;
+    char *restart_path = NULL;
+    char *capture_path = NULL;
+    unsigned int capture_mb = CAPTURE_DEFAULT_MB;
+    char *replay_path = NULL;
+    double replay_speed = 1;
+    char replay_direction = 'I';
+    char *loadgen_spec = NULL;
+    char *client_endpoint = NULL;
+    unsigned int session_idle = 0;
+    bool z_flag = false;
+    char *pool_spec = NULL;
+    char *group_spec = NULL;
+    double trace_rate = 0;
+    char *trace_path = NULL;
+    char *shm_arg = NULL;
+    char shm_flag = '\0';
+    char *file_input = NULL;
+    char *file_output = NULL;
+    char *mux_spec = NULL;
+    bool reliable_flag = false;
+
+    // Logging is set up first so that the options parsed below can already be logged
+    int verbosity = LOG_LEVEL_OFF;
+    char *log_path = NULL;
+    opterr = 0;
+    while ((opt = getopt(argc, argv, MYNC_OPTIONS)) != -1)
+    {
+        if (opt == 'v')
+            verbosity++;
+        else if (opt == 'l')
+            log_path = optarg;
+    }
+    log_init(verbosity, log_path);
+    opterr = 1;
+    optind = 1;
 
-    while ((opt = getopt(argc, argv, "e:t:i:o:b:")) != -1)
+    while ((opt = getopt(argc, argv, MYNC_OPTIONS)) != -1)
     {
         switch (opt)
         {
         case 'e':
             e_flag = true;
             command = optarg;
-            printf("Command: %s\n", command);
+            LOG_DEBUG("Command: %s\n", command);
             break;
         case 't':
             t_flag = true;
             time = atoi(optarg);
             if (time == 0)
             {
-                printf("Error: timeout param error\n");
+                fprintf(stderr, "Error: timeout param error\n");
+                return EXIT_FAILURE;
+            }
+            LOG_DEBUG("Time: %d\n", time);
+            break;
+        case 'a':
+            acceptor_path = optarg;
+            LOG_DEBUG("Acceptor control socket: %s\n", acceptor_path);
+            break;
+        case 'H':
+            restart_path = optarg;
+            LOG_DEBUG("Hot restart socket: %s\n", restart_path);
+            break;
+        case 'w':
+            worker_path = optarg;
+            LOG_DEBUG("Worker of acceptor: %s\n", worker_path);
+            break;
+        case 'z':
+            // -z 0 disables zero-copy sends
+            zerocopy_threshold = strtoul(optarg, NULL, 10);
+            z_flag = true;
+            LOG_DEBUG("Zero-copy threshold: %zu\n", zerocopy_threshold);
+            break;
+        case 'P':
+            pool_spec = optarg;
+            LOG_DEBUG("Upstream pool: %s\n", pool_spec);
+            break;
+        case 'm':
+            mux_spec = optarg;
+            LOG_DEBUG("Multiplexed link: %s\n", mux_spec);
+            break;
+        case 'R':
+            reliable_flag = true;
+            LOG_DEBUG("Reliable datagrams\n");
+            break;
+        case 'F':
+        {
+            // -F usec[,frame]
+            char *frame_str = strchr(optarg, ',');
+            if (frame_str != NULL)
+            {
+                *frame_str++ = '\0';
+                if (strcmp(frame_str, "frame") != 0)
+                {
+                    fprintf(stderr, "Error: adaptor param error\n");
+                    return EXIT_FAILURE;
+                }
+                adaptor_framing = true;
+            }
+            flush_deadline_us = atol(optarg);
+            if (flush_deadline_us < 0)
+            {
+                fprintf(stderr, "Error: adaptor param error\n");
+                return EXIT_FAILURE;
+            }
+            LOG_DEBUG("Adaptor flush deadline: %ld us, framing: %d\n", flush_deadline_us, adaptor_framing);
+            break;
+        }
+        case 'T':
+        {
+            // -T rate[,file]
+            char *file_str = strchr(optarg, ',');
+            if (file_str != NULL)
+            {
+                *file_str = '\0';
+                trace_path = file_str + 1;
+            }
+            trace_rate = atof(optarg);
+            if (trace_rate <= 0 || trace_rate > 1)
+            {
+                fprintf(stderr, "Error: trace rate param error\n");
+                return EXIT_FAILURE;
+            }
+            LOG_DEBUG("Trace rate: %g\n", trace_rate);
+            break;
+        }
+        case 'c':
+        {
+            // -c file[,megabytes]
+            capture_path = optarg;
+            char *size_str = strchr(optarg, ',');
+            if (size_str != NULL)
+            {
+                *size_str = '\0';
+                capture_mb = atoi(size_str + 1);
+                if (capture_mb == 0)
+                {
+                    fprintf(stderr, "Error: capture size param error\n");
+                    return EXIT_FAILURE;
+                }
+            }
+            LOG_DEBUG("Capture file: %s\n", capture_path);
+            break;
+        }
+        case 'r':
+        {
+            // -r file[,speed[,direction]]
+            replay_path = optarg;
+            char *speed_str = strchr(optarg, ',');
+            if (speed_str != NULL)
+            {
+                *speed_str++ = '\0';
+                replay_speed = atof(speed_str);
+                char *direction_str = strchr(speed_str, ',');
+                if (direction_str != NULL)
+                    replay_direction = direction_str[1];
+            }
+            if (replay_speed < 0 || (replay_direction != 'I' && replay_direction != 'O'))
+            {
+                fprintf(stderr, "Error: replay param error\n");
+                return EXIT_FAILURE;
+            }
+            LOG_DEBUG("Replay file: %s\n", replay_path);
+            break;
+        }
+        case 'v':
+        case 'l':
+            break;
+        case 's':
+            session_idle = atoi(optarg);
+            if (session_idle == 0)
+            {
+                fprintf(stderr, "Error: session idle param error\n");
                 return EXIT_FAILURE;
             }
-            printf("Time: %d\n", time);
+            LOG_DEBUG("UDP session idle timeout: %u\n", session_idle);
+            break;
+        case 'L':
+            loadgen_spec = optarg;
+            LOG_DEBUG("Load generator: %s\n", loadgen_spec);
             break;
         case 'i':
         case 'o':
         case 'b':
-            printf("Flag: %c\n", opt);
+            LOG_DEBUG("Flag: %c\n", opt);
+            if (strncmp(optarg, "TCPC", 4) == 0 || strncmp(optarg, "UDPC", 4) == 0 || strncmp(optarg, "UDSC", 4) == 0)
+                client_endpoint = optarg;
             if (strncmp(optarg, "TCPS", 4) == 0)
             {
-                printf("Argument: %s\n", optarg);
+                LOG_DEBUG("Argument: %s\n", optarg);
                 server = optarg;
                 flag_server = opt;
-                printf("Flag server: %c\n", flag_server);
+                LOG_DEBUG("Flag server: %c\n", flag_server);
             }
             else if (strncmp(optarg, "TCPC", 4) == 0)
             {
-                printf("Argument: %s\n", optarg);
+                LOG_DEBUG("Argument: %s\n", optarg);
                 client = optarg;
                 flag_client = opt;
-                printf("Flag client: %c\n", flag_client);
+                LOG_DEBUG("Flag client: %c\n", flag_client);
+            }
+            else if (strncmp(optarg, "GROUP", 5) == 0)
+            {
+                LOG_DEBUG("Argument: %s\n", optarg);
+                group_spec = optarg;
+                flag_client = opt;
+                LOG_DEBUG("Flag client: %c\n", flag_client);
+            }
+            else if (strncmp(optarg, "SHMS", 4) == 0 || strncmp(optarg, "SHMC", 4) == 0)
+            {
+                LOG_DEBUG("Argument: %s\n", optarg);
+                if (shm_arg != NULL || strlen(optarg + 4) == 0)
+                {
+                    fprintf(stderr, "Invalid SHM argument\n");
+                    return EXIT_FAILURE;
+                }
+                shm_arg = optarg;
+                shm_flag = opt;
+                LOG_DEBUG("Flag shared memory: %c\n", shm_flag);
+            }
+            else if (strncmp(optarg, "FILE", 4) == 0 || strncmp(optarg, "FIFO", 4) == 0)
+            {
+                LOG_DEBUG("Argument: %s\n", optarg);
+                if (opt == 'b' || strlen(optarg + 4) == 0)
+                {
+                    fprintf(stderr, "FILE and FIFO endpoints need a path and are one-way, use -i or -o\n");
+                    return EXIT_FAILURE;
+                }
+                if (opt == 'i')
+                    file_input = optarg;
+                else
+                    file_output = optarg;
             }
             else if (strncmp(optarg, "UDPS", 4) == 0)
             {
-                printf("Argument: %s\n", optarg);
+                LOG_DEBUG("Argument: %s\n", optarg);
                 server = optarg;
                 flag_server = opt;
-                printf("Flag server: %c\n", flag_server);
+                LOG_DEBUG("Flag server: %c\n", flag_server);
             }
             else if (strncmp(optarg, "UDPC", 4) == 0)
             {
-                printf("Argument: %s\n", optarg);
+                LOG_DEBUG("Argument: %s\n", optarg);
                 client = optarg;
                 flag_client = opt;
-                printf("Flag client: %c\n", flag_client);
+                LOG_DEBUG("Flag client: %c\n", flag_client);
             }
             else if (strncmp(optarg, "UDS", 3) == 0)
             {
@@ -578,46 +6685,62 @@ int main(int argc, char *argv[])
                 {
                     strncpy(fp, file_location, MAX_FILEPATH - 1); // Copy extracted path to filepath
                     fp[MAX_FILEPATH - 1] = '\0';                  // Ensure null-termination
-                    printf("Extracted path: %s\n", fp);
+                    LOG_DEBUG("Extracted path: %s\n", fp);
                 }
                 else
                 {
-                    printf("Invalid UDS argument\n");
+                    fprintf(stderr, "Invalid UDS argument\n");
                     return EXIT_FAILURE;
                 }
 
                 if (strncmp(optarg, "UDSSS", 5) == 0)
                 {
-                    printf("UDS server using stream\n");
-                    printf("file_location Path: %s\n", file_location);
+                    LOG_DEBUG("UDS server using stream\n");
+                    LOG_DEBUG("file_location Path: %s\n", file_location);
                     flag_server = opt;
-                    printf("Flag server: %c\n", flag_server);
+                    LOG_DEBUG("Flag server: %c\n", flag_server);
                     udsss = true;
                 }
                 if (strncmp(optarg, "UDSSD", 5) == 0)
                 {
-                    printf("UDS server using datagram\n");
-                    printf("file_location Path: %s\n", file_location);
+                    LOG_DEBUG("UDS server using datagram\n");
+                    LOG_DEBUG("file_location Path: %s\n", file_location);
                     flag_server = opt;
-                    printf("Flag server: %c\n", flag_server);
+                    LOG_DEBUG("Flag server: %c\n", flag_server);
                     udssd = true;
                 }
                 if (strncmp(optarg, "UDSCD", 5) == 0)
                 {
-                    printf("UDS client using datagram\n");
-                    printf("file_location Path: %s\n", file_location);
+                    LOG_DEBUG("UDS client using datagram\n");
+                    LOG_DEBUG("file_location Path: %s\n", file_location);
                     flag_client = opt;
-                    printf("Flag client: %c\n", flag_client);
+                    LOG_DEBUG("Flag client: %c\n", flag_client);
                     udscd = true;
                 }
                 if (strncmp(optarg, "UDSCS", 5) == 0)
                 {
-                    printf("UDS client using stream\n");
-                    printf("file_location Path: %s\n", file_location);
+                    LOG_DEBUG("UDS client using stream\n");
+                    LOG_DEBUG("file_location Path: %s\n", file_location);
                     flag_client = opt;
-                    printf("Flag client: %c\n", flag_client);
+                    LOG_DEBUG("Flag client: %c\n", flag_client);
                     udscs = true;
                 }
+                if (strncmp(optarg, "UDSSP", 5) == 0)
+                {
+                    LOG_DEBUG("UDS server using seqpacket\n");
+                    LOG_DEBUG("file_location Path: %s\n", file_location);
+                    flag_server = opt;
+                    LOG_DEBUG("Flag server: %c\n", flag_server);
+                    udssp = true;
+                }
+                if (strncmp(optarg, "UDSCP", 5) == 0)
+                {
+                    LOG_DEBUG("UDS client using seqpacket\n");
+                    LOG_DEBUG("file_location Path: %s\n", file_location);
+                    flag_client = opt;
+                    LOG_DEBUG("Flag client: %c\n", flag_client);
+                    udscp = true;
+                }
             }
             else
             {
@@ -631,61 +6754,195 @@ int main(int argc, char *argv[])
         }
     }
 
-    printf("Server: %s\n", server ?: "localhost");
+    LOG_DEBUG("Server: %s\n", server ?: "localhost");
+
+    if (loadgen_spec)
+    {
+        struct loadgen_config config;
+        if (client_endpoint == NULL || parse_client_target(client_endpoint, &config.target) == -1)
+        {
+            fprintf(stderr, "Load generator needs a TCPC, UDPC, UDSCS, UDSCD or UDSCP endpoint\n");
+            return EXIT_FAILURE;
+        }
+        if (parse_loadgen_config(loadgen_spec, &config) == -1)
+        {
+            fprintf(stderr, "Invalid load generator settings\n");
+            return EXIT_FAILURE;
+        }
+        run_loadgen(&config);
+    }
+    if (session_idle)
+    {
+        if (server == NULL || strncmp(server, "UDPS", 4) != 0)
+        {
+            fprintf(stderr, "UDP sessions need a UDPS endpoint\n");
+            return EXIT_FAILURE;
+        }
+        run_udp_sessions(atoi(server + 4), command, session_idle);
+    }
+    if (mux_spec)
+    {
+        static struct mux_state mux;
+        if (parse_mux_config(mux_spec, &mux.config) == -1)
+        {
+            fprintf(stderr, "Error: multiplexed link param error\n");
+            return EXIT_FAILURE;
+        }
+        bool tcp_server = server && strncmp(server, "TCPS", 4) == 0;
+        bool tcp_client = client && strncmp(client, "TCPC", 4) == 0;
+        mux.command = command;
+        if (tcp_client)
+            mux.port = split_host_port(client + 4, &mux.hostname);
+        if (mux.config.connect && tcp_client && (tcp_server || udsss))
+        {
+            char *fp = (flag_server == 'i') ? ifilepath : ofilepath;
+            mux.listen_fd = tcp_server ? open_tcp_listener(atoi(server + 4), SOMAXCONN) : open_uds_listener(fp, SOCK_STREAM, SOMAXCONN);
+        }
+        else if (!mux.config.connect && tcp_server && (command || tcp_client))
+            mux.listen_fd = open_tcp_listener(atoi(server + 4), SOMAXCONN);
+        else
+        {
+            fprintf(stderr, "-m connect needs a TCPS or UDSSS endpoint for the sessions and a TCPC endpoint for the link,\n"
+                            "-m accept needs a TCPS endpoint for the links and -e or a TCPC endpoint\n");
+            return EXIT_FAILURE;
+        }
+        if (mux.listen_fd == -1)
+            return EXIT_FAILURE;
+        run_mux(&mux);
+    }
+    if (acceptor_path)
+    {
+        struct acceptor_sockets sockets;
+        if (restart_path == NULL || hot_restart_takeover(restart_path, &sockets) == -1)
+        {
+            char *fp = (flag_server == 'i') ? ifilepath : ofilepath;
+            sockets.npending = 0;
+            sockets.restart_fd = -1;
+            if (server && strncmp(server, "TCPS", 4) == 0)
+                sockets.listen_fd = open_tcp_listener(atoi(server + 4), SOMAXCONN);
+            else if (udsss)
+                sockets.listen_fd = open_uds_listener(fp, SOCK_STREAM, SOMAXCONN);
+            else if (udssp)
+                sockets.listen_fd = open_uds_listener(fp, SOCK_SEQPACKET, SOMAXCONN);
+            else
+            {
+                fprintf(stderr, "Acceptor mode needs a TCPS, UDSSS or UDSSP endpoint\n");
+                return EXIT_FAILURE;
+            }
+            sockets.ctl_fd = open_uds_listener(acceptor_path, SOCK_SEQPACKET, MAX_WORKERS);
+            if (restart_path)
+                sockets.restart_fd = open_uds_listener(restart_path, SOCK_SEQPACKET, 1);
+            if (sockets.listen_fd == -1 || sockets.ctl_fd == -1 || (restart_path && sockets.restart_fd == -1))
+                return EXIT_FAILURE;
+        }
+        run_acceptor(&sockets, flag_server);
+    }
+    else if (restart_path)
+    {
+        fprintf(stderr, "Hot restart needs acceptor mode (-a)\n");
+        return EXIT_FAILURE;
+    }
+    if (shm_arg && (worker_path || acceptor_path || replay_path))
+    {
+        fprintf(stderr, "SHM endpoints work only with the relay, not with -w, -a or -r\n");
+        return EXIT_FAILURE;
+    }
+    if (reliable_flag && (session_idle || worker_path || acceptor_path || replay_path || mux_spec))
+    {
+        fprintf(stderr, "Reliable datagrams (-R) work only with the relay, not with -s, -w, -a, -r or -m\n");
+        return EXIT_FAILURE;
+    }
+    if ((file_input || file_output) && (worker_path || acceptor_path))
+    {
+        fprintf(stderr, "FILE and FIFO endpoints do not work with -w or -a\n");
+        return EXIT_FAILURE;
+    }
+    if (worker_path)
+    {
+        if (server || udsss || udssd || udssp)
+        {
+            fprintf(stderr, "Worker mode gets its server connections from the acceptor\n");
+            return EXIT_FAILURE;
+        }
+        struct upstream_pool *pool = NULL;
+        if (pool_spec)
+        {
+            if (client == NULL || strncmp(client, "TCPC", 4) != 0)
+            {
+                fprintf(stderr, "The upstream pool needs a TCPC endpoint\n");
+                return EXIT_FAILURE;
+            }
+            static struct upstream_pool upstream;
+            if (parse_pool_config(pool_spec, &upstream.config) == -1)
+            {
+                fprintf(stderr, "Error: pool param error\n");
+                return EXIT_FAILURE;
+            }
+            upstream.port = split_host_port(client + 4, &upstream.hostname);
+            upstream.flag = flag_client;
+            pool = &upstream;
+        }
+        struct backend_group *group = NULL;
+        if (group_spec)
+        {
+            static struct backend_group backends;
+            if (parse_backend_group(group_spec, &backends) == -1)
+            {
+                fprintf(stderr, "Invalid backend group\n");
+                return EXIT_FAILURE;
+            }
+            backends.flag = flag_client;
+            group = &backends;
+        }
+        // Returns in the forked session with input_fd/output_fd set
+        run_worker(worker_path, pool, group);
+    }
+    else if (pool_spec)
+    {
+        fprintf(stderr, "The upstream pool needs worker mode (-w)\n");
+        return EXIT_FAILURE;
+    }
 
     if (t_flag)
     {
-        printf("Setting timer to : %d seconds\n", time);
+        LOG_INFO("Setting timer to : %d seconds\n", time);
         signal(SIGALRM, closeResourcesAndExit);
         alarm(time);
     }
 
-    if (server == NULL && client == NULL && e_flag == false && !(udssd || udsss || udscs || udscd))
+    if (server == NULL && client == NULL && e_flag == false && !(udssd || udsss || udscs || udscd || udssp || udscp) && worker_path == NULL && capture_path == NULL && replay_path == NULL && group_spec == NULL && trace_rate == 0 && flush_deadline_us < 0 && shm_arg == NULL && file_input == NULL && file_output == NULL)
     {
-        printf("no excute given\n");
+        LOG_INFO("no excute given\n");
         chat_stdin_to_stdout();
     }
     if (server && strncmp(server, "TCPS", 4) == 0)
     {
         int port = atoi(server + 4);
-        printf("Port for TCP server: %d\n", port);
+        LOG_DEBUG("Port for TCP server: %d\n", port);
 
         if (flag_server == 'i')
-            configureInputOutput(true, false, false, true, false, port, NULL, NULL, 1, 0);
+            configureInputOutput(true, false, false, true, false, port, NULL, NULL, 1, 0, false);
         else if (flag_server == 'o')
-            configureInputOutput(true, false, false, true, false, port, NULL, NULL, 0, 1);
+            configureInputOutput(true, false, false, true, false, port, NULL, NULL, 0, 1, false);
         else if (flag_server == 'b')
-            configureInputOutput(true, false, false, true, false, port, NULL, NULL, 1, 1);
+            configureInputOutput(true, false, false, true, false, port, NULL, NULL, 1, 1, false);
         else
         {
             fprintf(stderr, "Invalid flag\n");
             return EXIT_FAILURE;
         }
     }
-    if (client && strncmp(client, "TCPC", 4) == 0)
+    if (client && strncmp(client, "TCPC", 4) == 0 && !upstream_ready)
     {
-        char *hostname = client + 4;
-        char *port_str = strchr(hostname, ',');
-        if (port_str == NULL)
-        {
-            // TCPS1234
-            port_str = hostname; // *port_str=1234
-            hostname = NULL;     // hostname=NULL
-        }
-        else
-        {
-            // TCPSmyserver,1234
-            *port_str = '\0'; // *hostname="myserver\0"
-            port_str++;       // *port_str=1234
-        }
-        int port = atoi(port_str);
-        printf("Port for TCP client: %d\n", port);
+        char *hostname;
+        int port = split_host_port(client + 4, &hostname);
+        LOG_DEBUG("Port for TCP client: %d\n", port);
         if (flag_client == 'i')
-            configureInputOutput(true, false, false, false, true, port, hostname, NULL, 1, 0);
+            configureInputOutput(true, false, false, false, true, port, hostname, NULL, 1, 0, false);
         else if (flag_client == 'o')
-            configureInputOutput(true, false, false, false, true, port, hostname, NULL, 0, 1);
+            configureInputOutput(true, false, false, false, true, port, hostname, NULL, 0, 1, false);
         else if (flag_client == 'b')
-            configureInputOutput(true, false, false, false, true, port, hostname, NULL, 1, 1);
+            configureInputOutput(true, false, false, false, true, port, hostname, NULL, 1, 1, false);
         else
         {
             fprintf(stderr, "Invalid flag\n");
@@ -695,13 +6952,13 @@ int main(int argc, char *argv[])
     if (server && strncmp(server, "UDPS", 4) == 0)
     {
         int port = atoi(server + 4);
-        printf("Port for UDP server: %d\n", port);
+        LOG_DEBUG("Port for UDP server: %d\n", port);
         if (flag_server == 'i')
-            configureInputOutput(false, true, false, true, false, port, NULL, NULL, 1, 0);
+            configureInputOutput(false, true, false, true, false, port, NULL, NULL, 1, 0, false);
         else if (flag_server == 'o')
-            configureInputOutput(false, true, false, true, false, port, NULL, NULL, 0, 1);
+            configureInputOutput(false, true, false, true, false, port, NULL, NULL, 0, 1, false);
         else if (flag_server == 'b')
-            configureInputOutput(false, true, false, true, false, port, NULL, NULL, 1, 1);
+            configureInputOutput(false, true, false, true, false, port, NULL, NULL, 1, 1, false);
         else
         {
             fprintf(stderr, "Invalid flag\n");
@@ -710,28 +6967,15 @@ int main(int argc, char *argv[])
     }
     if (client && strncmp(client, "UDPC", 4) == 0)
     {
-        char *hostname = client + 4;
-        char *port_str = strchr(hostname, ',');
-        if (port_str == NULL)
-        {
-            // UDPC1234
-            port_str = hostname; // *port_str=1234
-            hostname = NULL;     // hostname=NULL
-        }
-        else
-        {
-            // UDPCmyserver,1234
-            *port_str = '\0'; // *hostname="myserver\0"
-            port_str++;       // *port_str=1234
-        }
-        int port = atoi(port_str);
-        printf("Port for UDP client: %d\n", port);
+        char *hostname;
+        int port = split_host_port(client + 4, &hostname);
+        LOG_DEBUG("Port for UDP client: %d\n", port);
         if (flag_client == 'i')
-            configureInputOutput(false, true, false, false, true, port, hostname, NULL, 1, 0);
+            configureInputOutput(false, true, false, false, true, port, hostname, NULL, 1, 0, false);
         else if (flag_client == 'o')
-            configureInputOutput(false, true, false, false, true, port, hostname, NULL, 0, 1);
+            configureInputOutput(false, true, false, false, true, port, hostname, NULL, 0, 1, false);
         else if (flag_client == 'b')
-            configureInputOutput(false, true, false, false, true, port, hostname, NULL, 1, 1);
+            configureInputOutput(false, true, false, false, true, port, hostname, NULL, 1, 1, false);
         else
         {
             fprintf(stderr, "Invalid flag\n");
@@ -741,8 +6985,13 @@ int main(int argc, char *argv[])
 
     if (udssd)
     {
+        char *fp = (flag_server == 'i') ? ifilepath : ofilepath;
         if (flag_server == 'i')
-            configureInputOutput(false, true, true, true, false, 0, NULL, ifilepath, 1, 0);
+            configureInputOutput(false, true, true, true, false, 0, NULL, fp, 1, 0, false);
+        else if (flag_server == 'o')
+            configureInputOutput(false, true, true, true, false, 0, NULL, fp, 0, 1, false);
+        else if (flag_server == 'b')
+            configureInputOutput(false, true, true, true, false, 0, NULL, fp, 1, 1, false);
         else
         {
             fprintf(stderr, "Invalid flag\n");
@@ -751,8 +7000,13 @@ int main(int argc, char *argv[])
     }
     if (udscd)
     {
-        if (flag_client == 'o')
-            configureInputOutput(false, true, true, false, true, 0, NULL, ofilepath, 0, 1);
+        char *fp = (flag_client == 'i') ? ifilepath : ofilepath;
+        if (flag_client == 'i')
+            configureInputOutput(false, true, true, false, true, 0, NULL, fp, 1, 0, false);
+        else if (flag_client == 'o')
+            configureInputOutput(false, true, true, false, true, 0, NULL, fp, 0, 1, false);
+        else if (flag_client == 'b')
+            configureInputOutput(false, true, true, false, true, 0, NULL, fp, 1, 1, false);
         else
         {
             fprintf(stderr, "Invalid flag\n");
@@ -761,15 +7015,15 @@ int main(int argc, char *argv[])
     }
     if (udsss)
     {
-        printf("using UDSSS\n");
+        LOG_DEBUG("using UDSSS\n");
         char *fp = (flag_server == 'i') ? ifilepath : ofilepath;
-        printf("file location: %s\n", fp);
+        LOG_DEBUG("file location: %s\n", fp);
         if (flag_server == 'i')
-            configureInputOutput(false, true, true, true, false, 0, NULL, fp, 1, 0);
+            configureInputOutput(true, false, true, true, false, 0, NULL, fp, 1, 0, false);
         else if (flag_server == 'o')
-            configureInputOutput(false, true, true, true, false, 0, NULL, fp, 0, 1);
+            configureInputOutput(true, false, true, true, false, 0, NULL, fp, 0, 1, false);
         else if (flag_server == 'b')
-            configureInputOutput(false, true, true, true, false, 0, NULL, fp, 1, 1);
+            configureInputOutput(true, false, true, true, false, 0, NULL, fp, 1, 1, false);
         else
         {
             fprintf(stderr, "Invalid flag\n");
@@ -778,25 +7032,143 @@ int main(int argc, char *argv[])
     }
     if (udscs)
     {
-        printf("using UDSCS\n");
+        LOG_DEBUG("using UDSCS\n");
+        char *fp = (flag_client == 'i') ? ifilepath : ofilepath;
+        LOG_DEBUG("file location: %s\n", fp);
+        if (flag_client == 'i')
+            configureInputOutput(true, false, true, false, true, 0, NULL, fp, 1, 0, false);
+        else if (flag_client == 'o')
+            configureInputOutput(true, false, true, false, true, 0, NULL, fp, 0, 1, false);
+        else if (flag_client == 'b')
+            configureInputOutput(true, false, true, false, true, 0, NULL, fp, 1, 1, false);
+        else
+        {
+            fprintf(stderr, "Invalid flag\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (udssp)
+    {
+        LOG_DEBUG("using UDSSP\n");
+        char *fp = (flag_server == 'i') ? ifilepath : ofilepath;
+        LOG_DEBUG("file location: %s\n", fp);
+        if (flag_server == 'i')
+            configureInputOutput(false, false, true, true, false, 0, NULL, fp, 1, 0, true);
+        else if (flag_server == 'o')
+            configureInputOutput(false, false, true, true, false, 0, NULL, fp, 0, 1, true);
+        else if (flag_server == 'b')
+            configureInputOutput(false, false, true, true, false, 0, NULL, fp, 1, 1, true);
+        else
+        {
+            fprintf(stderr, "Invalid flag\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (udscp)
+    {
+        LOG_DEBUG("using UDSCP\n");
         char *fp = (flag_client == 'i') ? ifilepath : ofilepath;
-        printf("file location: %s\n", fp);
+        LOG_DEBUG("file location: %s\n", fp);
         if (flag_client == 'i')
-            configureInputOutput(false, true, true, false, true, 0, NULL, fp, 1, 0);
+            configureInputOutput(false, false, true, false, true, 0, NULL, fp, 1, 0, true);
         else if (flag_client == 'o')
-            configureInputOutput(false, true, true, false, true, 0, NULL, fp, 0, 1);
+            configureInputOutput(false, false, true, false, true, 0, NULL, fp, 0, 1, true);
         else if (flag_client == 'b')
-            configureInputOutput(false, true, true, false, true, 0, NULL, fp, 1, 1);
+            configureInputOutput(false, false, true, false, true, 0, NULL, fp, 1, 1, true);
         else
         {
             fprintf(stderr, "Invalid flag\n");
             return EXIT_FAILURE;
         }
     }
+    if (group_spec && !upstream_ready)
+    {
+        // Opened after the server endpoint, whose peer is the consistent hash key
+        static struct backend_group group;
+        if (parse_backend_group(group_spec, &group) == -1)
+        {
+            fprintf(stderr, "Invalid backend group\n");
+            return EXIT_FAILURE;
+        }
+        int backend;
+        int fd = group_connect(&group, group_session_key(flag_server == 'o' ? output_fd : input_fd), &backend);
+        if (fd == -1)
+            closeResourcesAndExit(EXIT_FAILURE);
+        LOG_INFO("Connected to backend %s\n", group.backends[backend].name);
+        if (flag_client == 'i' || flag_client == 'b')
+            input_fd = fd;
+        if (flag_client == 'o' || flag_client == 'b')
+            output_fd = fd;
+    }
+    if (shm_arg)
+    {
+        int fd = shm_arg[3] == 'S' ? shm_start_server(shm_arg + 4) : shm_start_client(shm_arg + 4);
+        if (shm_flag == 'i' || shm_flag == 'b')
+            input_fd = fd;
+        if (shm_flag == 'o' || shm_flag == 'b')
+            output_fd = fd;
+    }
+    if (file_input)
+        input_fd = strncmp(file_input, "FILE", 4) == 0 ? open_file_endpoint(file_input, 'i') : open_fifo_endpoint(file_input, 'i');
+    if (file_output)
+        output_fd = strncmp(file_output, "FILE", 4) == 0 ? open_file_endpoint(file_output, 'o') : open_fifo_endpoint(file_output, 'o');
+    if (reliable_flag)
+    {
+        bool input_udp = socket_option(input_fd, SO_PROTOCOL) == IPPROTO_UDP;
+        if (!input_udp && socket_option(output_fd, SO_PROTOCOL) != IPPROTO_UDP)
+        {
+            fprintf(stderr, "Reliable datagrams (-R) need a UDPS or UDPC endpoint\n");
+            closeResourcesAndExit(EXIT_FAILURE);
+        }
+        rel_start(input_udp ? input_fd : output_fd);
+    }
+    if (replay_path && append_direct)
+    {
+        fprintf(stderr, "A replay cannot write to an O_DIRECT file\n");
+        closeResourcesAndExit(EXIT_FAILURE);
+    }
 
-    printf("Input file descriptor: %d\n", input_fd);
-    printf("Output file descriptor: %d\n", output_fd);
-    if (e_flag)
+    LOG_DEBUG("Input file descriptor: %d\n", input_fd);
+    LOG_DEBUG("Output file descriptor: %d\n", output_fd);
+    if (replay_path)
+    {
+        // The capture takes the place of the input, into the command or straight to the output
+        int replay_fd = output_fd;
+        int to_child[2];
+        if (e_flag)
+        {
+            if (pipe2(to_child, O_CLOEXEC) == -1)
+            {
+                perror("pipe");
+                closeResourcesAndExit(EXIT_FAILURE);
+            }
+            int parent_fds[] = {to_child[1], input_fd, -1};
+            spawn_command(command, to_child[0], output_fd, parent_fds);
+            close(to_child[0]);
+            replay_fd = to_child[1];
+        }
+        replay_capture(replay_path, replay_speed, replay_direction, replay_fd);
+        if (e_flag)
+        {
+            close(to_child[1]);
+            waitpid(child, NULL, 0);
+            child = 0;
+        }
+        closeResourcesAndExit(EXIT_SUCCESS);
+    }
+    if (capture_path)
+    {
+        capture_open(capture_path, capture_mb);
+    }
+    if (trace_rate > 0)
+    {
+        trace_open(trace_rate, trace_path);
+    }
+    if (e_flag && (capture_path || z_flag || trace_rate > 0 || flush_deadline_us >= 0 || shm != NULL || append_direct || reliable != NULL))
+    {
+        run_command_relayed(command, time);
+    }
+    else if (e_flag)
     {
         if (input_fd != STDIN_FILENO)
         {
@@ -805,7 +7177,7 @@ int main(int argc, char *argv[])
                 perror("dup2 input");
                 closeResourcesAndExit(EXIT_FAILURE);
             }
-            printf("Input file descriptor changed to %d\n", input_fd);
+            LOG_DEBUG("Input file descriptor changed to %d\n", input_fd);
         }
 
         if (output_fd != STDOUT_FILENO)
@@ -815,29 +7187,27 @@ int main(int argc, char *argv[])
                 perror("dup2 output");
                 closeResourcesAndExit(EXIT_FAILURE);
             }
-            printf("Output file descriptor changed to %d\n", output_fd);
+            LOG_DEBUG("Output file descriptor changed to %d\n", output_fd);
         }
 
         // Run the program with the given arguments
         executeCommand(command);
     }
+    else if ((reliable != NULL || shm != NULL) && input_fd == output_fd)
+    {
+        // A reliable or shared memory session with -b and no command: stdin to the peer, the peer to stdout
+        static struct relay_path paths[2];
+        relay_path_init(&paths[0], STDIN_FILENO, output_fd, 'O');
+        relay_path_init(&paths[1], input_fd, STDOUT_FILENO, 'I');
+        relay_paths(paths, 2, time);
+        LOG_INFO("Exiting.\n");
+    }
     else
     {
-        while (true)
-        {
-            char buf[255];
-            ssize_t size;
-            if ((size = read(input_fd, buf, 255)) == -1)
-            {
-                fprintf(stderr, "Exiting.\n");
-                break;
-            }
-
-            write(output_fd, buf, size);
-
-            if (time)
-                alarm(time);
-        }
+        static struct relay_path path;
+        relay_path_init(&path, input_fd, output_fd, 'I');
+        relay_paths(&path, 1, time);
+        LOG_INFO("Exiting.\n");
     }
 
     return EXIT_SUCCESS;